@@ -10,8 +10,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <float.h>
+#include <stdint.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include "daisystats.h"
 
 // STB awesomeness
 #define STB_IMAGE_IMPLEMENTATION
@@ -33,12 +41,47 @@
 #ifdef WIN32
 #define WINDOWS_LEAN_AND_MEAN
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define CSV_SSE2
 #endif
 
 // constants
 #define invsqrt2 0.70710678118654752440084436210485
 #define pi_dbl 3.1415926535897932384626433832795
 
+// "-" as a file name means stdin or stdout
+inline bool IsStdStream(const char *filename)
+{
+	return filename && filename[0]=='-' && filename[1]==0;
+}
+
+// set stdin or stdout to binary on systems that care
+void SetBinaryStream(FILE *f)
+{
+#ifdef WIN32
+	_setmode(_fileno(f), _O_BINARY);
+#else
+	(void)f;
+#endif
+}
+
 const char Instructions[] = {
 	"\n"
 	"command line arguments:\n"
@@ -48,10 +91,17 @@ const char Instructions[] = {
 	" All command line arguments can also be rows in the top of input.csv file\n"
 	" If the only command line argument is a csv file a variety of guesses for\n"
 	"   command line arguments will be made based on the contents of that file.\n"
+	" Use - instead of input.csv to read the csv from stdin and - instead of output.png\n"
+	"   to write a png to stdout, messages are then written to stderr.\n"
 	"\n"
 	" a/aspect=<num> : aspect ratio for round or rect, divide width by height\n"
+	" ag/aggregate=<op>[:<column>] : One flower per name, or per column title or number, with\n"
+	"   the values combined by sum, mean, count or max\n"
 	" b/background=<color>/<image file> : set background color or image\n"
+	" bat/batch=<csv file>[:<summary file>] : Render every row of the csv file as its own set of\n"
+	"   command line arguments in one process, per job timings go to the summary file\n"
 	" c/color=<color> : set text color\n"
+	" com/compile=<file> : Save the flowers and csv arguments as a binary file to render again later\n"
 	" d/data=<csv file> : Load in a csv file that has values to represent\n"
 	" f/font=<font>: The font for legend, font should have a .ttf extension.\n"
 	" l/legend=<height> : add a legend of the data names at the bottom\n"
@@ -62,7 +112,13 @@ const char Instructions[] = {
 	" p/preset=<csv file> : Load in a csv file of preset flowers\n"
 	" r/random=<num> : Create <num> random sized flowers, uses presets\n"
 	" s/size=<num> : Make the result fit within this size (max width or height)\n"
-	" t/title=<size>:<name> : Add a title on the top of the page."
+	" se/seed=<num> : Seed for random values, the same seed and data gives the same image\n"
+	" ser/serve=<socket file>/<port> : Keep running and render http requests on a unix domain socket\n"
+	"   or a localhost port, the csv is the body and arguments are the query\n"
+	" st/stats=<json file> : Write the time of each phase of the run and counts of the work done, - is stderr\n"
+	" t/title=<size>:<name> : Add a title on the top of the page.\n"
+	" to/top=<num>[:<bins>] : Only keep the <num> largest flowers, the rest are combined into\n"
+	"   one flower or up to 16 bins of similar sizes\n"
 	"\n"
 	" Note about colors:\n"
 	"   The color parameter can be 0-15 for c64 palette, 000-fff for amiga, 0000-ffff amiga+alpha,\n"
@@ -116,8 +172,11 @@ const char Instructions[] = {
 
 enum arguments {
 	A_ASPECT,
+	A_AGGREGATE,
 	A_BACKGROUND,
+	A_BATCH,
 	A_COLOR,
+	A_COMPILE,
 	A_DATA,
 	A_FONT,
 	A_LEGEND,
@@ -127,15 +186,22 @@ enum arguments {
 	A_PRESET,
 	A_RANDOM,
 	A_SIZE,
+	A_SEED,
+	A_SERVE,
+	A_STATS,
 	A_TITLE,
+	A_TOP,
 	
 	A_COUNT
 };
 
 const char *cmd_args[] = {
 	"aspect",
+	"aggregate",
 	"background",
+	"batch",
 	"color",
+	"compile",
 	"data",
 	"font",
 	"legend",
@@ -145,9 +211,41 @@ const char *cmd_args[] = {
 	"preset",
 	"random",
 	"size",
-	"title"
+	"seed",
+	"serve",
+	"stats",
+	"title",
+	"top"
 };
 
+// the argument a command names by its longest matching prefix, A_COUNT if none
+arguments ArgumentIndex(const char *command)
+{
+	arguments best = A_COUNT;
+	int mostSame = 0;
+	for (int a=A_ASPECT; a<A_COUNT; a++) {
+		int same = 0; const char *f=command; const char *s=cmd_args[a];
+		while (*f && *f!='=' && tolower(*f++)==tolower(*s++)) same++;
+		if (same>mostSame) {
+			best = (arguments)a;
+			mostSame = same;
+		}
+	}
+	return best;
+}
+
+// arguments that read or write a file
+inline bool FileArgument(arguments a)
+{
+	return a==A_BATCH || a==A_COMPILE || a==A_DATA || a==A_FONT || a==A_PRESET || a==A_SERVE || a==A_STATS;
+}
+
+// arguments that pick what a run does with its data, compiled files don't keep them
+inline bool RunArgument(arguments a)
+{
+	return a==A_BATCH || a==A_COMPILE || a==A_DATA || a==A_SERVE;
+}
+
 enum fit {
 	FIT_ROUND,
 	FIT_RECT,
@@ -186,6 +284,24 @@ const char *sort_name[] = {
 	"name"
 };
 
+enum aggregate {
+	AGG_NONE,
+	AGG_SUM,
+	AGG_MEAN,
+	AGG_COUNT,
+	AGG_MAX,
+	
+	AGG_COUNT_OPS
+};
+
+const char *aggregate_name[] = {
+	"none",
+	"sum",
+	"mean",
+	"count",
+	"max"
+};
+
 enum ColumnIndex {
 	CLN_VALUE,
 	CLN_NAME,
@@ -223,6 +339,7 @@ const char *ColumnName[CLN_ENTRIES] = {
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 struct color { u8 r, g, b, a; };
 
 static const color c64[] = {
@@ -244,7 +361,8 @@ static const color c64[] = {
 	{187, 187, 187, 255}
 };
 
-static struct { const char *name; color col; } colornames[] = {
+struct color_name { const char *name; color col; };
+static constexpr color_name colornames[] = {
 	{ "tra", { 0,0,0,0 } },
 	{ "Bla", { 0, 0, 0, 255} },
 	{ "Blu", { 0, 0, 255, 255} },
@@ -287,7 +405,7 @@ static struct { const char *name; color col; } colornames[] = {
 	{ "Yel", { 255, 255, 0, 255} },
 	{ "Whi", { 255, 255, 255, 255} }
 };
-static const int num_colornames = sizeof(colornames) / sizeof(colornames[0]);
+static constexpr int num_colornames = sizeof(colornames) / sizeof(colornames[0]);
 
 #define font_file "GEORGIA.TTF"
 #ifdef WIN32
@@ -297,6 +415,123 @@ static const int num_colornames = sizeof(colornames) / sizeof(colornames[0]);
 #endif
 
 
+//
+//
+// TRACE
+//
+//
+
+// compile with DAISYSTATS_TRACE to record scoped events of the hot paths and write them
+// as chrome trace json (chrome://tracing or ui.perfetto.dev) when the process exits, the
+// file is daisystats_trace.json or the DAISYSTATS_TRACE environment variable. without it
+// the TRACE macros are empty.
+#ifdef DAISYSTATS_TRACE
+#define TRACE_EVENTS (1<<16)	// per thread, the oldest events are overwritten
+
+struct trace_event {
+	const char *name, *arg_name;
+	long long arg;
+	u64 begin, end;	// ns since the first event
+};
+
+struct trace_buffer {
+	trace_event events[TRACE_EVENTS];
+	u64 count;
+	int tid;
+	trace_buffer *next;
+};
+
+// buffers outlive their threads so batch workers are still there at exit
+struct trace_log {
+	std::mutex lock;
+	trace_buffer *buffers;
+	int threads;
+	std::chrono::steady_clock::time_point start;
+	trace_log() : buffers(nullptr), threads(0), start(std::chrono::steady_clock::now()) {}
+};
+
+trace_log& TraceLog()
+{
+	static trace_log log;
+	return log;
+}
+
+inline u64 TraceNow()
+{
+	return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - TraceLog().start).count();
+}
+
+void WriteTrace()
+{
+	trace_log &log = TraceLog();
+	std::lock_guard<std::mutex> guard(log.lock);
+	const char *filename = getenv("DAISYSTATS_TRACE");
+	FILE *f = fopen(filename && *filename ? filename : "daisystats_trace.json", "w");
+	if (!f)
+		return;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (trace_buffer *b = log.buffers; b; b = b->next) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", b->tid, b->tid);
+		first = false;
+		u64 begin = b->count>TRACE_EVENTS ? b->count-TRACE_EVENTS : 0;
+		for (u64 i = begin; i<b->count; i++) {
+			const trace_event &e = b->events[i & (TRACE_EVENTS-1)];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e.name, b->tid, e.begin*0.001, (e.end-e.begin)*0.001);
+			if (e.arg_name)
+				fprintf(f, ",\"args\":{\"%s\":%lld}", e.arg_name, e.arg);
+			fprintf(f, "}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+trace_buffer* TraceThread()
+{
+	thread_local trace_buffer *buffer = nullptr;
+	if (!buffer) {
+		buffer = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+		trace_log &log = TraceLog();
+		std::lock_guard<std::mutex> guard(log.lock);
+		buffer->tid = ++log.threads;
+		buffer->next = log.buffers;
+		log.buffers = buffer;
+		if (log.threads==1)
+			atexit(WriteTrace);
+	}
+	return buffer;
+}
+
+// an event from construction to destruction, written when it ends
+struct trace_scope {
+	const char *name, *arg_name;
+	long long arg;
+	u64 begin;
+
+	trace_scope(const char *n, const char *an = nullptr, long long a = 0) : name(n), arg_name(an), arg(a), begin(TraceNow()) {}
+	~trace_scope()
+	{
+		trace_buffer *b = TraceThread();
+		trace_event &e = b->events[b->count++ & (TRACE_EVENTS-1)];
+		e.name = name;
+		e.arg_name = arg_name;
+		e.arg = arg;
+		e.begin = begin;
+		e.end = TraceNow();
+	}
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name) trace_scope TRACE_JOIN(trace_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg_name, arg) trace_scope TRACE_JOIN(trace_, __LINE__)(name, arg_name, (long long)(arg))
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg_name, arg)
+#endif
+
+
 //
 //
 // RENDER FLOWERS
@@ -313,8 +548,10 @@ inline double petval4(double x, double y, double k)
 	return x*x+y*y+k*(x*x/(ay<ep?ep:ay)+y*y/(ax<ep?ep:ax));
 }
 
-void drawnpetal(unsigned int *bitmap, int bitmap_width, double x, double y, double r, double c, double a, double k, double f, unsigned int petcol, unsigned int ctrcol, int petals)
+// returns the number of pixels tested
+u64 drawnpetal(unsigned int *bitmap, int bitmap_width, double x, double y, double r, double c, double a, double k, double f, unsigned int petcol, unsigned int ctrcol, int petals)
 {
+	TRACE_SCOPE_ARG("drawnpetal", "radius", r);
 	double orc = r-c;
 	double tip_angle = (pi_dbl/4) * (2.0-f)/2.0;
 	double pe = petval4(cos(tip_angle), sin(tip_angle), k);
@@ -330,12 +567,18 @@ void drawnpetal(unsigned int *bitmap, int bitmap_width, double x, double y, doub
 	y -= (double)cy;
 	
 	int ir = (int)(2.0*(r+1.0));	// integer radius with buffer
+	u64 tested = 0;
 	
 	bitmap += size_t(cy-ir)*size_t(bitmap_width) + size_t(cx);
 	for (int v=-ir; v<=ir; v++) {
-		int w = int(sqrt(r*r+1.0-double(v*v)))+1;
-		unsigned int *draw = bitmap - w;
+		double d = r*r+1.0-double(v*v);
+		unsigned int *draw = bitmap;
 		bitmap += bitmap_width;
+		if (d<0.0)	// row is outside of the circle
+			continue;
+		int w = int(sqrt(d))+1;
+		draw -= w;
+		tested += u64(2*w+1);
 		for (int h=-w; h<=w; h++) {
 			double vx = double(h)+x;
 			double vy = double(v)+y;
@@ -353,200 +596,1008 @@ void drawnpetal(unsigned int *bitmap, int bitmap_width, double x, double y, doub
 			}
 		}
 	}
+	return tested;
 }
 
 
 //
 //
-// FILE READ
+// THREADS
 //
 //
 
 
-char* ReadFile(const char *filename, size_t &size, int padding=0)
+#define MAX_THREADS 64
+
+// cpu time of the calling thread
+inline double ThreadCPUMilliseconds()
 {
-	if (FILE *f=fopen(filename, "rb")) {
-		fseek(f, 0, SEEK_END);
-		size = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		if (char *data = (char*)malloc(size+padding)) {
-			fread(data, size, 1, f);
-			fclose(f);
-			return data;
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	u64 t = ((u64(kernel.dwHighDateTime)<<32) | kernel.dwLowDateTime) + ((u64(user.dwHighDateTime)<<32) | user.dwLowDateTime);
+	return (double)t / 10000.0;	// 100 ns units
+#else
+	timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return 1000.0 * (double)t.tv_sec + (double)t.tv_nsec / 1000000.0;
+#endif
+}
+
+// cpu time the workers spent on tasks started by this thread
+thread_local double helped_cpu_ms = 0.0;
+
+// Worker threads that run the indices of a task, the calling thread helps out. A task started
+// while another is running runs on the calling thread alone.
+struct thread_pool {
+	std::thread *workers;
+	int num_workers;
+	std::mutex lock, running;
+	std::condition_variable wake, done;
+	void (*func)(void *user, int index);
+	void *user;
+	int count, active;
+	std::atomic<int> next;
+	std::atomic<long long> helped_ns;	// cpu time of the workers on the current task
+	unsigned int generation;
+	bool quit;
+
+	thread_pool() : workers(nullptr), num_workers(0), func(nullptr), user(nullptr), count(0), active(0), next(0), helped_ns(0), generation(0), quit(false)
+	{
+		unsigned int hw = std::thread::hardware_concurrency();
+		num_workers = (hw>MAX_THREADS ? MAX_THREADS : (int)hw) - 1;
+		if (num_workers>0) {
+			workers = new std::thread[num_workers];
+			for (int w=0; w<num_workers; w++)
+				workers[w] = std::thread(&thread_pool::work, this);
 		}
-		fclose(f);
 	}
-	return nullptr;
-}
 
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		wake.notify_all();
+		for (int w=0; w<num_workers; w++)
+			workers[w].join();
+		delete[] workers;
+	}
+
+	int threads() const { return num_workers+1; }
+
+	void pull()
+	{
+		for (int i=next++; i<count; i=next++)
+			func(user, i);
+	}
+
+	void work()
+	{
+		unsigned int seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [&] { return quit || generation!=seen; });
+				if (quit)
+					return;
+				seen = generation;
+			}
+			double start = ThreadCPUMilliseconds();
+			pull();
+			helped_ns += (long long)((ThreadCPUMilliseconds() - start) * 1000000.0);
+			std::lock_guard<std::mutex> guard(lock);
+			if (!--active)
+				done.notify_one();
+		}
+	}
+
+	void run(int task_count, void (*task)(void *user, int index), void *task_user)
+	{
+		if (task_count<=1 || !num_workers || !running.try_lock()) {
+			for (int i=0; i<task_count; i++)
+				task(task_user, i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			func = task;
+			user = task_user;
+			count = task_count;
+			next = 0;
+			helped_ns = 0;
+			active = num_workers;
+			generation++;
+		}
+		wake.notify_all();
+		pull();
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			done.wait(guard, [&] { return active==0; });
+		}
+		helped_cpu_ms += (double)helped_ns / 1000000.0;
+		running.unlock();
+	}
+};
+
+thread_pool& Threads()
+{
+	static thread_pool pool;
+	return pool;
+}
 
+// call task(index) for each index from 0 to count-1 spread over the worker threads
+template<class F> void ParallelFor(int count, const F &task)
+{
+	Threads().run(count, [](void *user, int index) { (*(const F*)user)(index); }, (void*)&task);
+}
 
 
 //
 //
-// TGA
+// RUN MEMORY
 //
 //
 
+#define ARENA_BLOCK_SIZE (1<<20)
+#define ARENA_LARGE (ARENA_BLOCK_SIZE/4)
+#define ARENA_ALIGN 16
 
+// Memory that lives until the end of a run is taken from blocks that are released together.
+// Temporaries can be released back to a mark in reverse order, large allocations get a block
+// of their own so they can grow in place. Not thread safe, allocate before going parallel.
+struct arena {
+	struct block { block *prev; size_t size; };
+	struct mark { block *shared; size_t used, num_large; };
+	block *shared;		// blocks for small allocations, newest first
+	block *large;		// one allocation per block, newest first
+	size_t used;		// bytes used in the newest shared block
+	size_t num_large;
+	size_t held, peak;	// bytes of all blocks now and at most
 
-#pragma pack(push,1)
-struct STGAHeader
-{
-	u8    mIdentificationFieldSize;
-	u8    mColourMapType;
-	u8    mImageTypeCode;
-	u16   mColorMapOrigin;
-	u16   mColorMapLength;
-	u8    mColourMapEntrySize;
-	u16   mXOrigin;
-	u16   mYOrigin;
-	u16   mWidth;
-	u16   mHeight;
-	u8    mBPP;
-	u8    mImageDescriptorByte;
-};
-#pragma pack(pop)
+	arena() : shared(nullptr), large(nullptr), used(0), num_large(0), held(0), peak(0) {}
+	~arena() { clear(); }
 
-bool SaveTGA(const char *filename, u16 width, u16 height, u8 *data)
-{
-	FILE *fp;
-	if ((fp = fopen(filename, "wb"))) {
-		STGAHeader image;
-		image.mIdentificationFieldSize = 0;
-		image.mColourMapType = 0;
-		image.mImageTypeCode = 2;
-		image.mColorMapOrigin = 0;
-		image.mColorMapLength = 0;
-		image.mColourMapEntrySize = 0;
-		image.mXOrigin = 0;
-		image.mYOrigin = 0;
-		image.mWidth = width;
-		image.mHeight = height;
-		image.mBPP = 32;
-		image.mImageDescriptorByte = 8;
-		
-		fwrite(&image, 1, sizeof(image), fp);
-		for (int y = height-1; y>=0; --y)
-			fwrite(data + size_t(width)*4*size_t(y), width*4, 1, fp);
-		fclose(fp);
-		return true;
+	static size_t header() { return (sizeof(block) + ARENA_ALIGN-1) & ~size_t(ARENA_ALIGN-1); }
+	static size_t round(size_t bytes) { return (bytes + ARENA_ALIGN-1) & ~size_t(ARENA_ALIGN-1); }
+	static bool too_large(size_t bytes) { return bytes > (SIZE_MAX - ARENA_ALIGN - header()); }
+
+	void *alloc(size_t bytes)
+	{
+		if (too_large(bytes))	// rounding up and the block header would wrap
+			return nullptr;
+		bytes = round(bytes ? bytes : 1);
+		if (bytes>ARENA_LARGE) {
+			block *b = (block*)malloc(header() + bytes);
+			if (!b)
+				return nullptr;
+			b->prev = large;
+			b->size = bytes;
+			large = b;
+			num_large++;
+			hold(bytes);
+			return (char*)b + header();
+		}
+		if (!shared || (used+bytes)>shared->size) {
+			block *b = (block*)malloc(header() + ARENA_BLOCK_SIZE);
+			if (!b)
+				return nullptr;
+			b->prev = shared;
+			b->size = ARENA_BLOCK_SIZE;
+			shared = b;
+			used = 0;
+			hold(ARENA_BLOCK_SIZE);
+		}
+		void *ret = (char*)shared + header() + used;
+		used += bytes;
+		return ret;
+	}
+
+	// keep the contents of an earlier allocation in a larger one
+	void *grow(void *ptr, size_t prev_bytes, size_t bytes)
+	{
+		if (!ptr)
+			return alloc(bytes);
+		if (bytes<=prev_bytes)
+			return ptr;
+		if (too_large(bytes))
+			return nullptr;
+		size_t prev_size = round(prev_bytes ? prev_bytes : 1);
+		if (prev_size>ARENA_LARGE) {
+			for (block **link = &large; *link; link = &(*link)->prev) {
+				if (((char*)*link + header())==ptr) {
+					block *b = (block*)realloc(*link, header() + round(bytes));
+					if (!b)
+						return nullptr;
+					held -= b->size;
+					hold(round(bytes));
+					b->size = round(bytes);
+					*link = b;
+					return (char*)b + header();
+				}
+			}
+		} else if (((char*)ptr + prev_size)==((char*)shared + header() + used) &&
+				   (used - prev_size + round(bytes))<=shared->size && round(bytes)<=ARENA_LARGE) {
+			used += round(bytes) - prev_size;	// the newest allocation can extend in place
+			return ptr;
+		}
+		void *ret = alloc(bytes);
+		if (ret)
+			memcpy(ret, ptr, prev_bytes);
+		return ret;
+	}
+
+	void hold(size_t bytes)
+	{
+		held += header() + bytes;
+		if (held>peak)
+			peak = held;
+	}
+
+	// nullptr if count items don't fit in a size_t
+	template<class T> T *alloc(size_t count) { return count>(SIZE_MAX/sizeof(T)) ? nullptr : (T*)alloc(sizeof(T) * count); }
+	template<class T> T *alloc_zero(size_t count) { T *ret = alloc<T>(count); if (ret) memset(ret, 0, sizeof(T) * count); return ret; }
+	template<class T> T *grow(T *ptr, size_t prev_count, size_t count) { return count>(SIZE_MAX/sizeof(T)) ? nullptr : (T*)grow((void*)ptr, sizeof(T) * prev_count, sizeof(T) * count); }
+
+	mark get_mark() const { mark m = { shared, used, num_large }; return m; }
+
+	// trade blocks with another arena so memory can be kept between runs
+	void swap(arena &other)
+	{
+		block *s = shared, *l = large;
+		size_t u = used, n = num_large, h = held, p = peak;
+		shared = other.shared; large = other.large; used = other.used; num_large = other.num_large;
+		held = other.held; peak = other.peak;
+		other.shared = s; other.large = l; other.used = u; other.num_large = n;
+		other.held = h; other.peak = p;
+	}
+
+	// release everything allocated after the mark was taken, large blocks may have moved so they are counted
+	void release(const mark &m)
+	{
+		while (num_large>m.num_large) {
+			block *prev = large->prev;
+			held -= header() + large->size;
+			free(large);
+			large = prev;
+			num_large--;
+		}
+		while (shared!=m.shared) {
+			block *prev = shared->prev;
+			held -= header() + shared->size;
+			free(shared);
+			shared = prev;
+		}
+		used = m.used;
+	}
+
+	void clear()
+	{
+		mark none = { nullptr, 0, 0 };
+		release(none);
 	}
-	return false;
-}
 
+	// release everything but the oldest block so the next run starts without allocating
+	void reset()
+	{
+		block *oldest = shared;
+		while (oldest && oldest->prev)
+			oldest = oldest->prev;
+		mark first = { oldest, 0, 0 };
+		release(first);
+		peak = held;
+	}
+};
 
 
 //
 //
-// RENDER TEXT
+// RUN STATISTICS
 //
 //
 
+enum phase {
+	PHASE_PARSE,
+	PHASE_INFER,
+	PHASE_REORDER,
+	PHASE_PACK,
+	PHASE_FIT,
+	PHASE_PAINT,
+	PHASE_TEXT,
+	PHASE_ENCODE,
+	
+	PHASE_COUNT
+};
 
+const char *phase_name[] = {
+	"parse",
+	"infer",
+	"reorder",
+	"pack",
+	"fit",
+	"paint",
+	"text",
+	"encode"
+};
 
-static stbtt_fontinfo font;
-static const void *ttf_file = nullptr; // for shutdown cleanup
-static unsigned char *glyph_buf = nullptr;
-static unsigned int glyph_buf_wid = 0, glyph_buf_height = 0;
-
-const char *FontFolder(char* buf, size_t buf_size)
+inline double MillisecondsSince(std::chrono::steady_clock::time_point start)
 {
-#ifdef WIN32
-	if (int len = GetEnvironmentVariableA("WINDIR", buf, (DWORD)buf_size)) {
-		if ((buf_size-len)>=8) {
-			memcpy(buf+len, "\\fonts\\", 8);
-			return buf;
-		}
-	}
-#endif
-	return font_folder;
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
-bool InitFont(const char *fontname)
+// cpu time of the calling thread and of the workers that helped it, batch jobs and requests
+// on other threads are not included
+inline double CPUMilliseconds()
 {
-	size_t s;
-	char filename_buf[512], path_buf[512];
-	char *ttf_data = ReadFile(fontname, s);
-	if (!ttf_data) {
-		snprintf(filename_buf, sizeof(filename_buf), "%s.ttf",
-				 fontname);
-		ttf_data = ReadFile(filename_buf, s);
-		if (!ttf_data) {
-			snprintf(filename_buf, sizeof(filename_buf), "%s%s",
-					 FontFolder(path_buf, sizeof(path_buf)), fontname);
-			ttf_data = ReadFile(filename_buf, s);
-			if (!ttf_data) {
-				snprintf(filename_buf, sizeof(filename_buf), "%s%s.ttf",
-						 FontFolder(path_buf, sizeof(path_buf)), fontname);
-				ttf_data = ReadFile(filename_buf, s);
+	return ThreadCPUMilliseconds() + helped_cpu_ms;
+}
+
+// wall and cpu time of the phases of a run and counts of the work done, a phase can
+// begin and end more than once
+struct run_stats {
+	double wall[PHASE_COUNT], cpu[PHASE_COUNT];
+	std::chrono::steady_clock::time_point wall_start[PHASE_COUNT], run_start;
+	double cpu_start[PHASE_COUNT], run_cpu_start;
+	u64 place_calls;		// place_next_to
+	u64 collision_tests;	// placed flowers tested against a spot
+	u64 fallbacks;			// flowers that had to try all pairs of prior flowers
+	u64 pixels;				// pixels tested by drawnpetal
+	int flowers;
+
+	run_stats() { clear(); }
+
+	void clear()
+	{
+		for (int p=0; p<PHASE_COUNT; p++)
+			wall[p] = cpu[p] = 0.0;
+		place_calls = collision_tests = fallbacks = pixels = 0;
+		flowers = 0;
+		run_start = std::chrono::steady_clock::now();
+		run_cpu_start = CPUMilliseconds();
+	}
+
+	void begin(phase p)
+	{
+		wall_start[p] = std::chrono::steady_clock::now();
+		cpu_start[p] = CPUMilliseconds();
+	}
+
+	void end(phase p)
+	{
+		wall[p] += MillisecondsSince(wall_start[p]);
+		cpu[p] += CPUMilliseconds() - cpu_start[p];
+	}
+};
+
+#define PROGRESS_MS 250.0	// time between reports
+
+// progress of the phase that is running, reported to a callback or as text to messages.
+// the hot loops update it as they go and stop when it has been cancelled.
+struct run_progress {
+	daisy_progress func;
+	void *context;
+	FILE *messages;
+	std::atomic<bool> cancel;	// set from any thread
+	phase current;
+	std::chrono::steady_clock::time_point start, last;
+
+	run_progress() : func(nullptr), context(nullptr), messages(nullptr), cancel(false), current(PHASE_PARSE) {}
+
+	bool cancelled() const { return cancel.load(std::memory_order_relaxed); }
+
+	void begin(phase p)
+	{
+		current = p;
+		start = last = std::chrono::steady_clock::now();
+	}
+
+	// report done out of total every PROGRESS_MS and at the end to the callback, total is 0 if
+	// not known. returns false when cancelled.
+	bool update(u64 done, u64 total)
+	{
+		if (func || messages) {
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			double since = std::chrono::duration<double, std::milli>(now - last).count();
+			bool finished = total && done>=total;
+			if (since>=PROGRESS_MS || (finished && func)) {
+				double elapsed = std::chrono::duration<double>(now - start).count();
+				double left = done && total ? elapsed * double(total-done) / double(done) : -1.0;
+				last = now;
+				if (func)
+					func(context, phase_name[current], (long long)done, (long long)total, left);
+				else if (total) {
+					fprintf(messages, "%s %llu / %llu, %.1f s left   \r", phase_name[current],
+							(unsigned long long)done, (unsigned long long)total, left);
+					fflush(messages);
+				}
 			}
 		}
+		return !cancelled();
 	}
-	
-	if (ttf_data) {
-		ttf_file = ttf_data;
-		if (!stbtt_InitFont(&font, (unsigned char*)ttf_data, 0)) {
-			free(ttf_data);
-			return false;
+};
+
+
+//
+//
+// FILE READ
+//
+//
+
+
+char* ReadFile(const char *filename, size_t &size, arena &memory, int padding=0)
+{
+	FILE *f = IsStdStream(filename) ? stdin : fopen(filename, "rb");
+	if (!f)
+		return nullptr;
+	char *data = nullptr;
+	long len = -1;
+	if (f!=stdin && fseek(f, 0, SEEK_END)==0) {
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+	}
+	if (len>=0) {
+		size = len;
+		if ((data = memory.alloc<char>(size+padding)))
+			fread(data, size, 1, f);
+	} else { // pipes can't tell the size up front
+		if (f==stdin)
+			SetBinaryStream(stdin);
+		size_t cap = 0;
+		size = 0;
+		for (;;) {
+			if ((size+padding)>=cap) {
+				size_t prev_cap = cap;
+				cap = cap ? cap*2 : 65536;
+				char *grow = memory.grow(data, prev_cap, cap);
+				if (!grow) { data = nullptr; break; }
+				data = grow;
+			}
+			size_t got = fread(data+size, 1, cap-size-padding, f);
+			if (!got)
+				break;
+			size += got;
 		}
-		printf("Loaded Font \"%s\"\n", fontname);
-		return true;
 	}
-	return false;
+	if (f!=stdin)
+		fclose(f);
+	return data;
 }
 
-void ShutdownFont()
+// file contents mapped copy-on-write so they can be modified in place
+struct mapped_file {
+	char *data;
+	size_t size;
+};
+
+// map a file with at least padding writable bytes after the end, returns nullptr if can't map
+mapped_file* MapFile(const char *filename, size_t padding=0)
 {
-	if (ttf_file) {
-		free((void*)ttf_file);
-		ttf_file = nullptr;
+	char *data = nullptr;
+	size_t size = 0;
+#ifdef WIN32
+	HANDLE h = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h!=INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER li;
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		if (GetFileSizeEx(h, &li) && li.QuadPart && (!padding || ((size_t(li.QuadPart) % si.dwPageSize)!=0 &&
+			(si.dwPageSize - size_t(li.QuadPart) % si.dwPageSize)>=padding))) {
+			if (HANDLE m = CreateFileMappingA(h, NULL, PAGE_WRITECOPY, 0, 0, NULL)) {
+				data = (char*)MapViewOfFile(m, FILE_MAP_COPY, 0, 0, 0);
+				size = size_t(li.QuadPart);
+				CloseHandle(m);
+			}
+		}
+		CloseHandle(h);
 	}
-	if (glyph_buf) {
-		free((void*)glyph_buf);
-		glyph_buf = nullptr;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd>=0) {
+		struct stat st;
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		// bytes past the end of the file up to the page size are zero filled and writable
+		if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size && (!padding || ((size_t(st.st_size) % page)!=0 &&
+			(page - size_t(st.st_size) % page)>=padding))) {
+			void *map = mmap(nullptr, size_t(st.st_size), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (map!=MAP_FAILED) {
+				data = (char*)map;
+				size = size_t(st.st_size);
+			}
+		}
+		close(fd);
 	}
+#endif
+	if (!data)
+		return nullptr;
+	mapped_file *file = (mapped_file*)malloc(sizeof(mapped_file));
+	file->data = data;
+	file->size = size;
+	return file;
 }
 
-float FontSizeScale(float height)
+// drop modified pages of a mapped range that won't be used again
+void ReleaseMappedRange(mapped_file *file, size_t begin, size_t end)
 {
-	return stbtt_ScaleForPixelHeight(&font, height);
+#ifndef WIN32
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	begin = (begin + page-1) & ~(page-1);
+	end &= ~(page-1);
+	if (end>begin)
+		madvise(file->data + begin, end-begin, MADV_DONTNEED);
+#endif
 }
 
-int FontBaseline()
+void UnmapFile(mapped_file *file)
 {
-	int ascent, descent;
-	stbtt_GetFontVMetrics(&font, &ascent, &descent, 0);
-	return ascent;
+	if (!file)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(file->data);
+#else
+	munmap(file->data, file->size);
+#endif
+	free(file);
 }
 
-int FontCenterHgt()
-{
-	int ascent, descent;
-	stbtt_GetFontVMetrics(&font, &ascent, &descent, 0);
-	return (ascent+descent)/2;
-}
+#define STRING_BLOCK_SIZE 65536
 
-#define TTY_GUARD 2048
-void DrawCodepointAt(int codepoint, double x, double y, float scale, color col, unsigned int *bm_trg, int wid, int hgt)
+// storage for strings that outlive the file or chunk of a file they were read from
+struct string_pool {
+	char *block;	// first bytes of each block link to the previous block
+	size_t used, size;
+
+	string_pool() : block(nullptr), used(0), size(0) {}
+	~string_pool() { clear(); }
+
+	const char *add(const char *str)
+	{
+		size_t len = strlen(str)+1;
+		char *ret = alloc(len);
+		memcpy(ret, str, len);
+		return ret;
+	}
+
+	char *alloc(size_t len)
+	{
+		if ((used+len)>size) {
+			size_t bs = (len+sizeof(char*))>STRING_BLOCK_SIZE ? (len+sizeof(char*)) : STRING_BLOCK_SIZE;
+			char *b = (char*)malloc(bs);
+			*(char**)b = block;
+			block = b;
+			used = sizeof(char*);
+			size = bs;
+		}
+		char *ret = block + used;
+		used += len;
+		return ret;
+	}
+
+	// move the strings of another pool into this one
+	void take(string_pool &other)
+	{
+		if (!other.block)
+			return;
+		char *oldest = other.block;
+		while (*(char**)oldest)
+			oldest = *(char**)oldest;
+		*(char**)oldest = block;
+		block = other.block;
+		used = other.used;
+		size = other.size;
+		other.block = nullptr;
+		other.used = other.size = 0;
+	}
+
+	void clear()
+	{
+		while (block) {
+			char *prev = *(char**)block;
+			free(block);
+			block = prev;
+		}
+		used = size = 0;
+	}
+};
+
+// map of names to an index, case insensitive by default, names are not copied
+struct name_map {
+	struct slot { const char *name; unsigned int hash; int index; };
+	slot *slots;
+	unsigned int mask, count;
+	bool ignore_case;
+
+	name_map(bool ignore_case=true) : slots(nullptr), mask(0), count(0), ignore_case(ignore_case) {}
+	~name_map() { clear(); }
+
+	unsigned int hash(const char *str) const
+	{
+		unsigned int h = 2166136261U;
+		while (unsigned char c = (unsigned char)*str++)
+			h = (h ^ (unsigned int)(ignore_case ? tolower(c) : c)) * 16777619U;
+		return h;
+	}
+
+	void grow()
+	{
+		slot *prev = slots;
+		unsigned int prev_size = slots ? mask+1 : 0;
+		mask = prev_size ? (prev_size*2-1) : 255;
+		slots = (slot*)calloc(mask+1, sizeof(slot));
+		for (unsigned int i=0; i<prev_size; i++) {
+			if (prev[i].name) {
+				unsigned int s = prev[i].hash & mask;
+				while (slots[s].name) s = (s+1) & mask;
+				slots[s] = prev[i];
+			}
+		}
+		if (prev) free(prev);
+	}
+
+	// slot of the name, or the empty slot to insert it at
+	slot &lookup(const char *name)
+	{
+		if (!slots || (count*2)>mask)
+			grow();
+		unsigned int h = hash(name), s = h & mask;
+		while (slots[s].name) {
+			if (slots[s].hash==h && (ignore_case ? strcasecmp(slots[s].name, name) : strcmp(slots[s].name, name))==0)
+				return slots[s];
+			s = (s+1) & mask;
+		}
+		slots[s].hash = h;
+		return slots[s];
+	}
+
+	// first name added that matches or nullptr
+	const slot *find_slot(const char *name)
+	{
+		slot &s = lookup(name);
+		return s.name ? &s : nullptr;
+	}
+
+	// index of the first name added that matches or -1
+	int find(const char *name)
+	{
+		const slot *s = find_slot(name);
+		return s ? s->index : -1;
+	}
+
+	// index of a matching name, or adds the name with index
+	int insert(const char *name, int index)
+	{
+		slot &s = lookup(name);
+		if (!s.name) {
+			s.name = name;
+			s.index = index;
+			count++;
+		}
+		return s.index;
+	}
+
+	void clear()
+	{
+		if (slots) free(slots);
+		slots = nullptr;
+		mask = count = 0;
+	}
+};
+
+// flower names and values by index, equal names share an index and
+// names that only differ in case share a group
+#define NO_STRING 0xffffffff
+
+struct string_table {
+	string_pool pool;		// strings of the run, also arguments that have no index
+	name_map exact, folded;
+	const char **strs;
+	u32 *groups;
+	u32 count, capacity;
+
+	string_table() : exact(false), folded(true), strs(nullptr), groups(nullptr), count(0), capacity(0) {}
+	~string_table() { clear(); }
+
+	// copy a string for the rest of the run
+	const char *keep(const char *str) { return pool.add(str); }
+
+	// indices for strings that are set later, each is its own group
+	u32 reserve(u32 num)
+	{
+		if ((count+num)>capacity) {
+			capacity = (count+num)>(capacity*2) ? (count+num) : capacity*2;
+			strs = (const char**)realloc(strs, sizeof(const char*) * capacity);
+			groups = (u32*)realloc(groups, sizeof(u32) * capacity);
+		}
+		u32 first = count;
+		for (u32 i=0; i<num; i++) {
+			strs[count] = nullptr;
+			groups[count] = count;
+			count++;
+		}
+		return first;
+	}
+
+	// string that outlives the table or is kept by it
+	void set(u32 index, const char *str) { strs[index] = str; }
+
+	// index of a string that is not looked up again
+	u32 add(const char *str)
+	{
+		u32 index = reserve(1);
+		strs[index] = keep(str);
+		return index;
+	}
+
+	// index of a kept string that is looked up by name
+	u32 insert(const char *kept)
+	{
+		int index = exact.find(kept);
+		if (index>=0)
+			return (u32)index;
+		index = (int)reserve(1);
+		strs[index] = kept;
+		exact.insert(kept, index);
+		groups[index] = (u32)folded.insert(kept, index);
+		return (u32)index;
+	}
+
+	// index of a name, copied if new
+	u32 intern(const char *str)
+	{
+		int index = exact.find(str);
+		return index>=0 ? (u32)index : insert(keep(str));
+	}
+
+	const char *get(u32 index) const { return index==NO_STRING ? nullptr : strs[index]; }
+
+	// first index of names that only differ in case
+	u32 group(u32 index) const { return index==NO_STRING ? NO_STRING : groups[index]; }
+
+	void clear()
+	{
+		pool.clear();
+		exact.clear();
+		folded.clear();
+		if (strs) free(strs);
+		if (groups) free(groups);
+		strs = nullptr;
+		groups = nullptr;
+		count = capacity = 0;
+	}
+};
+
+
+
+//
+//
+// TGA
+//
+//
+
+
+
+#pragma pack(push,1)
+struct STGAHeader
+{
+	u8    mIdentificationFieldSize;
+	u8    mColourMapType;
+	u8    mImageTypeCode;
+	u16   mColorMapOrigin;
+	u16   mColorMapLength;
+	u8    mColourMapEntrySize;
+	u16   mXOrigin;
+	u16   mYOrigin;
+	u16   mWidth;
+	u16   mHeight;
+	u8    mBPP;
+	u8    mImageDescriptorByte;
+};
+#pragma pack(pop)
+
+void WriteTGA(stbi_write_func *func, void *context, u16 width, u16 height, const u8 *data)
+{
+	STGAHeader image;
+	image.mIdentificationFieldSize = 0;
+	image.mColourMapType = 0;
+	image.mImageTypeCode = 2;
+	image.mColorMapOrigin = 0;
+	image.mColorMapLength = 0;
+	image.mColourMapEntrySize = 0;
+	image.mXOrigin = 0;
+	image.mYOrigin = 0;
+	image.mWidth = width;
+	image.mHeight = height;
+	image.mBPP = 32;
+	image.mImageDescriptorByte = 8;
+	
+	func(context, &image, sizeof(image));
+	for (int y = height-1; y>=0; --y)
+		func(context, (void*)(data + size_t(width)*4*size_t(y)), width*4);
+}
+
+// write the image as png, tga or bmp, returns false for other formats
+bool WriteImage(const char *format, stbi_write_func *func, void *context, int width, int height, const unsigned int *bitmap)
+{
+	if (strcasecmp(format, "png")==0) {
+		TRACE_SCOPE_ARG("WritePNG", "pixels", width*height);
+		return stbi_write_png_to_func(func, context, width, height, 4, bitmap, 0)!=0;
+	}
+	if (strcasecmp(format, "tga")==0) {
+		TRACE_SCOPE_ARG("WriteTGA", "pixels", width*height);
+		WriteTGA(func, context, (u16)width, (u16)height, (const u8*)bitmap);
+		return true;
+	}
+	if (strcasecmp(format, "bmp")==0) {
+		TRACE_SCOPE_ARG("WriteBMP", "pixels", width*height);
+		return stbi_write_bmp_to_func(func, context, width, height, 4, bitmap)!=0;
+	}
+	return false;
+}
+
+void WriteToFile(void *context, void *data, int size)
+{
+	fwrite(data, 1, size, (FILE*)context);
+}
+
+// encoded images grow in an arena
+struct encode_buffer {
+	arena *memory;
+	unsigned char *data;
+	size_t size, capacity;
+};
+
+void WriteToBuffer(void *context, void *data, int size)
+{
+	encode_buffer &buf = *(encode_buffer*)context;
+	if ((buf.size+size)>buf.capacity) {
+		size_t capacity = (buf.size+size)>(buf.capacity*2) ? (buf.size+size) : buf.capacity*2;
+		buf.data = buf.memory->grow(buf.data, buf.size, capacity);
+		buf.capacity = capacity;
+	}
+	memcpy(buf.data+buf.size, data, size);
+	buf.size += size;
+}
+
+
+
+//
+//
+// RENDER TEXT
+//
+//
+
+
+
+// a loaded font of a run, font file and glyph buffer live as long as the run
+struct font_state {
+	stbtt_fontinfo info;
+	arena *memory;
+	unsigned char *glyph_buf;
+	unsigned int glyph_buf_wid, glyph_buf_height;
+
+	font_state() : memory(nullptr), glyph_buf(nullptr), glyph_buf_wid(0), glyph_buf_height(0) {}
+};
+
+const char *FontFolder(char* buf, size_t buf_size)
+{
+#ifdef WIN32
+	if (int len = GetEnvironmentVariableA("WINDIR", buf, (DWORD)buf_size)) {
+		if ((buf_size-len)>=8) {
+			memcpy(buf+len, "\\fonts\\", 8);
+			return buf;
+		}
+	}
+#endif
+	return font_folder;
+}
+
+bool InitFont(font_state &font, const char *fontname, arena &memory)
+{
+	size_t s;
+	char filename_buf[512], path_buf[512];
+	font.memory = &memory;
+	char *ttf_data = ReadFile(fontname, s, memory);
+	if (!ttf_data) {
+		snprintf(filename_buf, sizeof(filename_buf), "%s.ttf",
+				 fontname);
+		ttf_data = ReadFile(filename_buf, s, memory);
+		if (!ttf_data) {
+			snprintf(filename_buf, sizeof(filename_buf), "%s%s",
+					 FontFolder(path_buf, sizeof(path_buf)), fontname);
+			ttf_data = ReadFile(filename_buf, s, memory);
+			if (!ttf_data) {
+				snprintf(filename_buf, sizeof(filename_buf), "%s%s.ttf",
+						 FontFolder(path_buf, sizeof(path_buf)), fontname);
+				ttf_data = ReadFile(filename_buf, s, memory);
+			}
+		}
+	}
+	
+	return ttf_data && stbtt_InitFont(&font.info, (unsigned char*)ttf_data, 0);
+}
+
+// the memory of the font goes with the run
+void ShutdownFont(font_state &font)
+{
+	font.memory = nullptr;
+	font.glyph_buf = nullptr;
+	font.glyph_buf_wid = font.glyph_buf_height = 0;
+}
+
+// fonts loaded once and shared by runs on any thread, glyph buffers stay with each run
+#define MAX_CACHED_FONTS 16
+
+struct font_cache {
+	std::mutex lock;
+	arena memory;
+	const char *names[MAX_CACHED_FONTS];
+	stbtt_fontinfo infos[MAX_CACHED_FONTS];
+	bool loaded[MAX_CACHED_FONTS];
+	int count;
+
+	font_cache() : count(0) {}
+
+	bool get(font_state &font, const char *fontname, arena &run_memory)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		int f = 0;
+		while (f<count && strcmp(names[f], fontname)!=0)
+			f++;
+		if (f==count) {
+			if (count==MAX_CACHED_FONTS)
+				return InitFont(font, fontname, run_memory);
+			size_t len = strlen(fontname)+1;
+			char *name = memory.alloc<char>(len);
+			memcpy(name, fontname, len);
+			names[f] = name;
+			loaded[f] = InitFont(font, fontname, memory);
+			infos[f] = font.info;
+			count++;
+		}
+		font.info = infos[f];
+		font.memory = &run_memory;
+		return loaded[f];
+	}
+};
+
+float FontSizeScale(const font_state &font, float height)
+{
+	return stbtt_ScaleForPixelHeight(&font.info, height);
+}
+
+int FontBaseline(const font_state &font)
+{
+	int ascent, descent;
+	stbtt_GetFontVMetrics(&font.info, &ascent, &descent, 0);
+	return ascent;
+}
+
+int FontCenterHgt(const font_state &font)
+{
+	int ascent, descent;
+	stbtt_GetFontVMetrics(&font.info, &ascent, &descent, 0);
+	return (ascent+descent)/2;
+}
+
+#define TTY_GUARD 2048
+void DrawCodepointAt(font_state &font, int codepoint, double x, double y, float scale, color col, unsigned int *bm_trg, int wid, int hgt)
 {
+	TRACE_SCOPE_ARG("DrawCodepointAt", "codepoint", codepoint);
 	// cache the memory block for drawing characters to reduce allocs
 	int bx0, by0, bx1, by1;
-	stbtt_GetCodepointBitmapBoxSubpixel(&font, codepoint, scale, scale, (float)(x - floor(x)), (float)(y - floor(y)), &bx0, &by0, &bx1, &by1);
+	stbtt_GetCodepointBitmapBoxSubpixel(&font.info, codepoint, scale, scale, (float)(x - floor(x)), (float)(y - floor(y)), &bx0, &by0, &bx1, &by1);
 	
-	int prev_size = glyph_buf_wid * glyph_buf_height;
+	int prev_size = font.glyph_buf_wid * font.glyph_buf_height;
 	int new_size = (bx1 - bx0) * (by1 - by0);
-	if (!glyph_buf || new_size > prev_size) {
-		if (glyph_buf)
-			free(glyph_buf);
-		glyph_buf = (unsigned char*)malloc(TTY_GUARD * 2 + new_size * sizeof(unsigned int));
-		glyph_buf_wid = bx1 - bx0;
-		glyph_buf_height = by1 - by0;
+	if (!font.glyph_buf || new_size > prev_size) {
+		font.glyph_buf = font.memory->alloc<unsigned char>(TTY_GUARD * 2 + new_size * sizeof(unsigned int));
+		font.glyph_buf_wid = bx1 - bx0;
+		font.glyph_buf_height = by1 - by0;
 	}
 	int wc=bx1-bx0, hc=by1-by0, ox=bx0, oy=by0;
 	
-	stbtt_MakeCodepointBitmapSubpixel(&font, glyph_buf + TTY_GUARD, wc, hc, wc, scale, scale, (float)(x - floor(x)), (float)(y - floor(y)), codepoint);
-	unsigned char *bm_char = glyph_buf + TTY_GUARD;
+	stbtt_MakeCodepointBitmapSubpixel(&font.info, font.glyph_buf + TTY_GUARD, wc, hc, wc, scale, scale, (float)(x - floor(x)), (float)(y - floor(y)), codepoint);
+	unsigned char *bm_char = font.glyph_buf + TTY_GUARD;
 	
 	int ix = ox + (int)x, iy = oy + (int)y;
 	int w = (ix+wc)<wid ? wc : (wid-ix), h = (iy+hc)<hgt ? hc : (hgt-iy);
@@ -585,10 +1636,11 @@ void DrawCodepointAt(int codepoint, double x, double y, float scale, color col,
 	}
 }
 
-void DrawTextAt(const unsigned char *utf8, float scale, double x, double y, color col, unsigned int *bm_trg, int wid, int hgt)
+void DrawTextAt(font_state &font, const unsigned char *utf8, float scale, double x, double y, color col, unsigned int *bm_trg, int wid, int hgt)
 {
+	TRACE_SCOPE("DrawTextAt");
 	int ascent, advance, lsb;
-	stbtt_GetFontVMetrics(&font, &ascent,0,0);
+	stbtt_GetFontVMetrics(&font.info, &ascent,0,0);
 	int prevcode = 0;
 	for (;;) {
 		int code = *utf8++;
@@ -600,15 +1652,15 @@ void DrawTextAt(const unsigned char *utf8, float scale, double x, double y, colo
 		}
 		if (!code) break;
 		if (prevcode)
-			x += scale * stbtt_GetCodepointKernAdvance(&font, prevcode, code);
-		DrawCodepointAt(code, x, y, scale, col, bm_trg, wid, hgt);
-		stbtt_GetCodepointHMetrics(&font, code, &advance, &lsb);
+			x += scale * stbtt_GetCodepointKernAdvance(&font.info, prevcode, code);
+		DrawCodepointAt(font, code, x, y, scale, col, bm_trg, wid, hgt);
+		stbtt_GetCodepointHMetrics(&font.info, code, &advance, &lsb);
 		x += scale * advance;
 	}
 }
 
 struct textspace { int minx, maxx, miny, maxy; };
-textspace GetTextSpace(const unsigned char *utf8)
+textspace GetTextSpace(const font_state &font, const unsigned char *utf8)
 {
 	int advance, lsb, prevcode = 0;
 	int xp = 0, yp = 0;
@@ -624,22 +1676,44 @@ textspace GetTextSpace(const unsigned char *utf8)
 		}
 		if (!code) break;
 		int ix0, iy0, ix1, iy1;
-		stbtt_GetCodepointBitmapBox(&font, code, 1.0f, 1.0f, &ix0, &iy0, &ix1, &iy1);
+		stbtt_GetCodepointBitmapBox(&font.info, code, 1.0f, 1.0f, &ix0, &iy0, &ix1, &iy1);
 		if (minx>(xp+ix0)) minx = xp+ix0;
 		if (miny>(yp+iy0)) miny = yp+iy0;
 		if (maxx<(xp+ix1)) maxx = xp+ix1;
 		if (maxy<(yp+iy1)) maxy = yp+iy1;
 		if (prevcode)
-			xp += stbtt_GetCodepointKernAdvance(&font, prevcode, code);
-		stbtt_GetCodepointHMetrics(&font, code, &advance, &lsb);
+			xp += stbtt_GetCodepointKernAdvance(&font.info, prevcode, code);
+		stbtt_GetCodepointHMetrics(&font.info, code, &advance, &lsb);
 		xp += advance;
 		prevcode = code;
 	}
 	textspace ret = { minx, maxx, miny, maxy };
 	return ret;
-	
+
 }
 
+// names drawn smaller than this many pixels high are skipped
+#define MIN_LABEL_PIXELS 6.0
+
+// text metrics by name index so repeated names are only measured once
+struct label_cache {
+	textspace *spaces;
+	u8 *measured;
+
+	label_cache(u32 count, arena &memory) :
+		spaces(memory.alloc<textspace>(count)),
+		measured(memory.alloc_zero<u8>(count)) {}
+
+	const textspace &get(const font_state &font, const string_table &strings, u32 name)
+	{
+		if (!measured[name]) {
+			spaces[name] = GetTextSpace(font, (const unsigned char*)strings.get(name));
+			measured[name] = 1;
+		}
+		return spaces[name];
+	}
+};
+
 
 //
 //
@@ -648,25 +1722,77 @@ textspace GetTextSpace(const unsigned char *utf8)
 //
 
 
-double dblrand()
+// what a random stream is used for, the same seed gives the same result for each
+enum rng_use {
+	RNG_ROWS,		// one stream per csv row
+	RNG_RANDOM,		// one stream per random flower
+	RNG_ORDER,
+	RNG_PACK,
+	RNG_OTHER
+};
+
+// xoshiro256** seeded by splitmix64, streams of the same seed are independent so
+// each row or flower can get its own generator on any thread and in any order
+struct rng {
+	u64 s[4];
+
+	static u64 splitmix64(u64 &x)
+	{
+		u64 z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+		return z ^ (z>>31);
+	}
+
+	static u64 rotl(u64 x, int k) { return (x<<k) | (x>>(64-k)); }
+
+	rng(u64 seed, rng_use use, u64 index=0)
+	{
+		u64 x = seed;
+		u64 h = splitmix64(x) ^ ((u64(use)<<48) + index);
+		for (int i=0; i<4; i++)
+			s[i] = splitmix64(h);
+	}
+
+	u64 next()
+	{
+		u64 result = rotl(s[1]*5, 7)*9;
+		u64 t = s[1]<<17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+	// 0 to 1, 1 not included
+	double unit() { return double(next()>>11) * (1.0/9007199254740992.0); }
+
+	// 0 to n-1
+	u32 below(u32 n) { return u32(((next()>>32) * u64(n))>>32); }
+};
+
+double dblrand(rng &random)
 {
-	return double(rand()) / double(RAND_MAX);
+	return random.unit();
 }
 
-unsigned char byterand(unsigned char low, unsigned char high)
+unsigned char byterand(rng &random, unsigned char low, unsigned char high)
 {
 	unsigned int li = low;
 	unsigned int lh = high;
-	unsigned int r = rand()%65535;
+	unsigned int r = random.below(65535);
 	return r * (li + lh + 32768) / 65535;
 }
 
-color colrand(color low, color high, u8 linear)
+color colrand(rng &random, color low, color high, u8 linear)
 {
-	unsigned int rr = rand()%255;
-	unsigned int rg = rand()%255;
-	unsigned int rb = rand()%255;
-	unsigned int ra = rand()%255;
+	unsigned int rr = random.below(255);
+	unsigned int rg = random.below(255);
+	unsigned int rb = random.below(255);
+	unsigned int ra = random.below(255);
 	
 	// linear = 0 => no influence
 	// linear = 255 => all the same
@@ -695,7 +1821,8 @@ struct flower_pack {
 	double x, y, r;
 };
 
-struct flower {
+// flower properties as read from a csv file, ranges and presets are pairs of low and high
+struct flower_spec {
 	double c, a, k, f;
 	const char *name, *value;
 	color col_pet, col_ctr;
@@ -703,86 +1830,155 @@ struct flower {
 	u8 lin_pet, lin_ctr;	// 0 = rgb cube interp, 255 = straight
 };
 
+// a flower to draw, name and value are indices in the string table of the run
+struct flower {
+	float c, a, k, f;
+	u32 name, value;
+	color col_pet, col_ctr;
+	u8 type;				// petal count
+	u8 lin_pet, lin_ctr;
+};
+
 struct flower_pair {
 	int first, second;
 };
 
-static flower_pack default_low_pack = { -10000.0, -10000.0, 1.0 };
-static flower_pack default_high_pack = { 10000.0, 10000.0, 32.0 };
+static const flower_pack default_low_pack = { -10000.0, -10000.0, 1.0 };
+static const flower_pack default_high_pack = { 10000.0, 10000.0, 32.0 };
 
-static flower default_low = {
+static const flower_spec default_low = {
 	0.15, 0.0, 0.0001, 0.0, nullptr, nullptr,
 	{0x40,0x40,0x40,0xff}, {0,0,0,0xff}, 3, 0, 0
 };
 
-static flower default_high = {
+static const flower_spec default_high = {
 	0.4, 6.24, 0.5, 0.0, nullptr, nullptr,
 	{0xff, 0xff, 0xff, 0xff}, {0xff, 0xff, 0xff, 0xff}, 18, 0, 0
 };
 
-struct flower_sort_pack { size_t o; double r; };
 struct flower_sort_name { size_t o; const char *n; };
-union flower_sort { flower_sort_pack p;	flower_sort_name n; };
 
-static int flower_larger(const void* p1, const void* p2)
+static int flower_name(const void* p1, const void* p2)
 {
-	return ((const flower_sort_pack*)p1)->r > ((const flower_sort_pack*)p2)->r ? -1 : 1;
+	const char *n1 = ((const flower_sort_name*)p1)->n;
+	const char *n2 = ((const flower_sort_name*)p2)->n;
+	int cmp = n1 == nullptr ? (n2 == nullptr ? 0 : -1) : (n2 == nullptr ? 1 : strcasecmp(n1, n2));
+	if (!cmp) // keep the original order of equal names
+		cmp = ((const flower_sort_name*)p1)->o < ((const flower_sort_name*)p2)->o ? -1 : 1;
+	return cmp;
 }
 
-static int flower_smaller(const void* p1, const void* p2)
+// order by radix sort on the keys, equal keys keep their order, keys_tmp is scratch of count keys
+static void radix_order(u64 *keys, u64 *keys_tmp, int count, int *perm, arena &memory)
 {
-	return ((const flower_sort_pack*)p1)->r < ((const flower_sort_pack*)p2)->r ? -1 : 1;
+	arena::mark temp = memory.get_mark();
+	int *perm_tmp = memory.alloc<int>(count);
+	u64 same = ~0ULL;
+	for (int p = 0; p < count; p++) {
+		same &= ~(keys[p] ^ keys[0]);
+		perm[p] = p;
+	}
+	for (int shift = 0; shift < 64; shift += 8) {
+		if (((same>>shift)&0xff)==0xff)
+			continue;	// all keys have the same byte here
+		int offs[256] = { 0 };
+		for (int p = 0; p < count; p++)
+			offs[(keys[p]>>shift)&0xff]++;
+		for (int b = 0, sum = 0; b < 256; b++) {
+			int c = offs[b];
+			offs[b] = sum;
+			sum += c;
+		}
+		for (int p = 0; p < count; p++) {
+			int d = offs[(keys[p]>>shift)&0xff]++;
+			keys_tmp[d] = keys[p];
+			perm_tmp[d] = perm[p];
+		}
+		u64 *k = keys; keys = keys_tmp; keys_tmp = k;
+		memcpy(perm, perm_tmp, sizeof(int) * count);
+	}
+	memory.release(temp);
 }
 
-static int flower_name(const void* p1, const void* p2)
+// move each flower to its place in the order in one pass over the cycles of the permutation
+static void apply_order(flower *flowers, flower_pack *pack, int count, int *perm)
 {
-	const char *n1 = ((const flower_sort_name*)p1)->n;
-	const char *n2 = ((const flower_sort_name*)p2)->n;
-	return n1 == nullptr ? (n2 == nullptr ? 0 : -1) : (n2 == nullptr ? 1 : strcasecmp(n1, n2));
+	for (int start = 0; start < count; start++) {
+		if (perm[start] == start)
+			continue;
+		flower f = flowers[start];
+		flower_pack fp = pack[start];
+		int dst = start;
+		for (;;) {
+			int src = perm[dst];
+			perm[dst] = dst;
+			if (src == start) {
+				flowers[dst] = f;
+				pack[dst] = fp;
+				break;
+			}
+			flowers[dst] = flowers[src];
+			pack[dst] = pack[src];
+			dst = src;
+		}
+	}
 }
 
-void reorder(flower *flowers, flower_pack *pack, int count, sort order)
+void reorder(flower *flowers, flower_pack *pack, int count, sort order, u64 seed, const string_table &strings, arena &memory)
 {
-	if (!count)
+	if (!count || order == SORT_ORIG)
 		return;
 	
+	arena::mark temp = memory.get_mark();
+	int *perm = memory.alloc<int>(count);	// flower index for each place
 	if (order==SORT_SHUFFLE) {
-		flower *flowers_tmp = (flower*)malloc(sizeof(flower) * count);
-		memcpy(flowers_tmp, flowers, sizeof(flower) * count);
-		flower_pack *pack_tmp = (flower_pack*)malloc(sizeof(flower_pack) * count);
-		memcpy(pack_tmp, pack, sizeof(flower_pack) * count);
-		for (int n=0; n<count; n++) {
-			int l = count - n;
-			int r = rand()%l;
-			flowers[n] = flowers_tmp[r];
-			pack[n] = pack_tmp[r];
-			memmove(flowers_tmp+r, flowers_tmp+r+1, sizeof(flower) * (l-r));
-			memmove(pack_tmp+r, pack_tmp+r+1, sizeof(flower_pack) * (l-r));
-		}
-		free(flowers_tmp);
-		free(pack_tmp);
-	} else if (order == SORT_SMALL || order == SORT_LARGE || order == SORT_NAME) {
-		flower_sort *aPack = (flower_sort*)malloc(sizeof(flower_sort) * count);
+		rng random(seed, RNG_ORDER);
+		for (int p = 0; p < count; p++)
+			perm[p] = p;
+		for (int n = count-1; n > 0; n--) {
+			int r = (int)random.below(n+1);
+			int t = perm[n]; perm[n] = perm[r]; perm[r] = t;
+		}
+	} else {
+		u64 *keys = memory.alloc<u64>(count * 2);
 		if (order == SORT_NAME) {
-			for (int p = 0; p < count; p++) { aPack[p].n.n = flowers[p].name; aPack[p].n.o = p; }
+			// sort each distinct name once and order the flowers by rank, no name goes first
+			u32 *rank = memory.alloc_zero<u32>(strings.count);
+			flower_sort_name *aName = memory.alloc<flower_sort_name>(strings.count);
+			int num_names = 0;
+			for (int p = 0; p < count; p++) {
+				u32 g = strings.group(flowers[p].name);
+				if (g != NO_STRING && !rank[g]) {
+					rank[g] = 1;
+					aName[num_names].n = strings.get(g);
+					aName[num_names].o = g;
+					num_names++;
+				}
+			}
+			qsort(aName, num_names, sizeof(flower_sort_name), flower_name);
+			for (int n = 0; n < num_names; n++)
+				rank[aName[n].o] = n+1;
+			for (int p = 0; p < count; p++) {
+				u32 g = strings.group(flowers[p].name);
+				keys[p] = g == NO_STRING ? 0 : rank[g];
+			}
 		} else {
-			for (int p = 0; p < count; p++) { aPack[p].p.r = pack[p].r; aPack[p].p.o = p; }
+			for (int p = 0; p < count; p++) {
+				u64 bits;
+				memcpy(&bits, &pack[p].r, sizeof(bits));
+				bits = (bits>>63) ? ~bits : (bits | (1ULL<<63));	// doubles compare as unsigned integers
+				keys[p] = order == SORT_LARGE ? ~bits : bits;
+			}
 		}
-		qsort(aPack, count, sizeof(flower_sort_pack), order== SORT_NAME ? flower_name:(order==SORT_LARGE ? flower_larger:flower_smaller));
-		flower_pack *aTempPack = (flower_pack*)malloc(sizeof(flower_pack) * count);
-		for (int p = 0; p < count; p++) { aTempPack[p] = pack[aPack[p].p.o]; }
-		memcpy(pack, aTempPack, sizeof(flower_pack) * count);
-		free(aTempPack);
-		flower *aTempFlow = (flower*)malloc(sizeof(flower) * count);
-		for (int p = 0; p < count; p++) { aTempFlow[p] = flowers[aPack[p].p.o]; }
-		memcpy(flowers, aTempFlow, sizeof(flower) * count);
-		free(aTempFlow);
-		free(aPack);
-	} // re-implement name sorting
+		radix_order(keys, keys + count, count, perm, memory);
+	}
+	apply_order(flowers, pack, count, perm);
+	memory.release(temp);
 }
 
-bool place_next_to(flower_pack *flowers, flower_pack *f, flower_pack *f_first, flower_pack *f_second, double &best_dist, double &x, double &y, double aspect, fit shape)
+bool place_next_to(flower_pack *flowers, flower_pack *f, flower_pack *f_first, flower_pack *f_second, double &best_dist, double &x, double &y, double aspect, fit shape, run_stats &stats)
 {
+	stats.place_calls++;
 	double x0 = f_first->x;
 	double y0 = f_first->y;
 	double x1 = f_second->x;
@@ -808,7 +2004,8 @@ bool place_next_to(flower_pack *flowers, flower_pack *f, flower_pack *f_first, f
 			ox*ox+aspect*aspect*oy*oy;
 			if (td<best_dist) {
 				bool blocked = false;
-				for (flower_pack *c = flowers; c<f; c++) {
+				flower_pack *c = flowers;
+				for (; c<f; c++) {
 					if (c!=f_first && c!=f_second) {
 						ox = c->x-tx;
 						oy = c->y-ty;
@@ -819,6 +2016,7 @@ bool place_next_to(flower_pack *flowers, flower_pack *f, flower_pack *f_first, f
 						}
 					}
 				}
+				stats.collision_tests += (c-flowers) + (blocked ? 1 : 0);
 				if (!blocked) {
 					best_dist = td;
 					x = tx;
@@ -833,35 +2031,38 @@ bool place_next_to(flower_pack *flowers, flower_pack *f, flower_pack *f_first, f
 
 inline double sqr(double x) { return x*x; }
 
-#ifdef WIN32
-#define UPDATE_PER 100
-#else
-#define UPDATE_PER 20
-#endif
-
-void pack_flowers(flower_pack *flowers, int count, fit shape, double aspect)
+// stops early when the progress is cancelled
+void pack_flowers(flower_pack *flowers, int count, fit shape, double aspect, u64 seed, arena &memory, run_progress &progress, run_stats &stats)
 {
 	if (!count)
 		return;
 	
-#ifdef WIN32
-	time_t last_time; time(&last_time);
-#endif
-	
-	int max_pairs = count*count, num_pairs = 0;
-	flower_pair *prs = (flower_pair*)malloc(sizeof(flower_pair)*max_pairs);
+	// each placed flower adds two pairs, more only when all prior flowers have to be tried
+	arena::mark temp = memory.get_mark();
+	int max_pairs = count*2+2, num_pairs = 0;
+	flower_pair *prs = memory.alloc<flower_pair>(max_pairs);
+	auto add_pair = [&](int first, int second) {
+		if (num_pairs==max_pairs) {
+			prs = memory.grow(prs, max_pairs, max_pairs*2);
+			max_pairs *= 2;
+		}
+		prs[num_pairs].first = first;
+		prs[num_pairs].second = second;
+		num_pairs++;
+	};
 	
 	double x = 0.0;
 	double y = 0.0;
 	
 	int n = 0;
-	int rep = count/UPDATE_PER;
 	for (flower_pack* f = flowers; f<(flowers + count); f++) {
+		TRACE_SCOPE_ARG("place", "flower", f-flowers);
 		
 		double r = f->r;
 		
 		if (n==1) {
-			double a = dblrand()*3.14129654*2.0;	// pick a random angle and place there
+			rng random(seed, RNG_PACK);
+			double a = dblrand(random)*3.14129654*2.0;	// pick a random angle and place there
 			double rs = r + flowers->r;
 			x = flowers->x + cos(a) * rs;
 			y = flowers->y + sin(a) * rs;
@@ -874,11 +2075,15 @@ void pack_flowers(flower_pack *flowers, int count, fit shape, double aspect)
 			int best_pair = -1;
 			if (shape==FIT_MOST || shape==FIT_BOX) {
 				for (flower_pack *f2 = flowers; f2<f; f2++) {
+					if (progress.cancelled()) {	// all pairs of prior flowers can take a while
+						memory.release(temp);
+						return;
+					}
 					for (flower_pack *f3 = flowers; f3<f2; f3++) {
 						double r3 = f->r + f2->r + f3->r;
 						double d2 = sqr(f3->x-f2->x) + sqr(f3->y-f2->y);
 						if (d2 < sqr(r3)) {
-							if (place_next_to(flowers, f, f2, f3, best_dist, x, y, aspect, shape)) {
+							if (place_next_to(flowers, f, f2, f3, best_dist, x, y, aspect, shape, stats)) {
 								found++;
 							}
 						}
@@ -889,36 +2094,32 @@ void pack_flowers(flower_pack *flowers, int count, fit shape, double aspect)
 					int p = shape==FIT_LAST ? num_pairs-1-pi : pi;
 					const flower_pair &pair = prs[p];
 					if (place_next_to(flowers, f, &flowers[pair.first], &flowers[pair.second],
-									  best_dist, x, y, aspect, shape)) {
+									  best_dist, x, y, aspect, shape, stats)) {
 						found++;
 						best_pair = p;
 					}
 					if ((shape==FIT_FIRST || shape==FIT_LAST) && found)
 						break;
 				}
-				if ((num_pairs+1)<max_pairs) {
-					if (found) {
-						prs[num_pairs].first = prs[best_pair].first;
-						prs[num_pairs].second = n;
-						num_pairs++;
-						prs[num_pairs].first = prs[best_pair].second;
-						prs[num_pairs].second = n;
-						num_pairs++;
-					} else {
-						// FAIL! Try all prior instead of just the pairs..
-						for (int first=n-1; first>0; --first) {
-							for (int second=first-1; second>=0; --second) {
-								if (place_next_to(flowers, f, &flowers[first], &flowers[second],
-												  best_dist, x, y, aspect, shape)) {
-									prs[num_pairs].first = first;
-									prs[num_pairs].second = n;
-									num_pairs++;
-									prs[num_pairs].first = second;
-									prs[num_pairs].second = n;
-									num_pairs++;
-									found++;
-									break;
-								}
+				if (found) {
+					flower_pair best = prs[best_pair];
+					add_pair(best.first, n);
+					add_pair(best.second, n);
+				} else {
+					// FAIL! Try all prior instead of just the pairs..
+					stats.fallbacks++;
+					for (int first=n-1; first>0; --first) {
+						if (progress.cancelled()) {
+							memory.release(temp);
+							return;
+						}
+						for (int second=first-1; second>=0; --second) {
+							if (place_next_to(flowers, f, &flowers[first], &flowers[second],
+											  best_dist, x, y, aspect, shape, stats)) {
+								add_pair(first, n);
+								add_pair(second, n);
+								found++;
+								break;
 							}
 						}
 					}
@@ -928,38 +2129,29 @@ void pack_flowers(flower_pack *flowers, int count, fit shape, double aspect)
 		f->x = x;
 		f->y = y;
 		n++;
-#ifdef WIN32
-		time_t curr_time; time(&curr_time);
-		if (difftime(curr_time, last_time)>4) { last_time = curr_time; rep=n-1; }
-#endif
-		if (n>rep) {
-			printf("completed %d / %d\r", (int)(f-flowers), count);
-			fflush(stdout);
-			rep = n + count/UPDATE_PER;
-		}
+		if (!progress.update(u64(n), u64(count)))
+			break;
 	}
-	free(prs);
+	memory.release(temp);
 }
 
-// create a flower in a random range
-void initflower(flower *f, flower_pack *p, const flower &low, const flower &high, const flower_pack &low_p, const flower_pack &high_p)
+// create a flower in a random range, name and value are left for the caller
+void initflower(rng &random, flower *f, flower_pack *p, const flower_spec &low, const flower_spec &high, const flower_pack &low_p, const flower_pack &high_p)
 {
 	p->x = 0.0;
 	p->y = 0.0;
-	p->r = dblrand()*(high_p.r-low_p.r)+low_p.r;
-	f->c = dblrand()*(high.c-low.c)+low.c;
-	f->a = dblrand()*(high.a-low.a)+low.a;
-	f->k = dblrand()*(high.k-low.k)+low.k;
-	f->f = dblrand()*(high.f-low.f)+low.f;
-	f->name = low.name;
-	f->value = low.value;
-	f->col_ctr = colrand(low.col_ctr, high.col_ctr, low.lin_ctr);
-	f->col_pet = colrand(low.col_pet, high.col_pet, low.lin_pet);
+	p->r = dblrand(random)*(high_p.r-low_p.r)+low_p.r;
+	f->c = (float)(dblrand(random)*(high.c-low.c)+low.c);
+	f->a = (float)(dblrand(random)*(high.a-low.a)+low.a);
+	f->k = (float)(dblrand(random)*(high.k-low.k)+low.k);
+	f->f = (float)(dblrand(random)*(high.f-low.f)+low.f);
+	f->name = NO_STRING;
+	f->value = NO_STRING;
+	f->col_ctr = colrand(random, low.col_ctr, high.col_ctr, low.lin_ctr);
+	f->col_pet = colrand(random, low.col_pet, high.col_pet, low.lin_pet);
 	f->type = low.type;
-	if (high.type>low.type) {
-		int rando = abs((rand()*113)>>8);
-		f->type += rando % (high.type-low.type);
-	}
+	if (high.type>low.type)
+		f->type += (u8)random.below(high.type-low.type);
 }
 
 
@@ -988,28 +2180,6 @@ int isNumeric(const char *s)
 	return 1;
 }
 
-int stringIsText(const char *str)
-{
-	if (isNumeric(str)>=2)
-		return 0;
-	int textScore = 0;
-	int length = 0;
-	while (char c = *str++) {
-		if ((c>='A' && c<='Z') || (c>='a' && c<='z'))
-			textScore++;
-		length++;
-	}
-	return length ? (textScore * 2) / length : 0;
-}
-
-int columnTextScore(const char **pCells, int col, int columns, int rows)
-{
-	int total = 0;
-	for (int r=0; r<rows; r++)
-		total += stringIsText(pCells[r*columns+col]);
-	return total;
-}
-
 int rowIsMeaningful(const char **pCells, int columns, int value_index, int count_index)
 {
 	bool empty = true;
@@ -1045,18 +2215,6 @@ bool notOneOf(int value, int *set, int set_size)
 }
 
 
-bool isHexOrDec(const char *val)
-{
-	while (*val==' ') val++;
-	while (unsigned char c = (unsigned char)*val++) {
-		if (c==' ')
-			break;
-		if (!(c>='0' && c<='9') && !(c>='a' && c<='f') && !(c>='A' && c<='F'))
-			return false;
-	}
-	return true;
-}
-
 const char* strlastchar(const char *str, char t)
 {
 	if (!str)
@@ -1068,6 +2226,57 @@ const char* strlastchar(const char *str, char t)
 	return end;
 }
 
+// statistics of the first rows of each column for guessing the roles of columns
+struct column_profile {
+	int cells;		// non-empty cells
+	int empty;		// empty cells
+	int numeric;	// sum of isNumeric of the cells below the titles
+	int text;		// sum of text scores, 2 for all letters to 0 for numbers
+	int ranges;		// cells written as "low to high"
+};
+
+// profile all columns in one pass, rows before first_value only count as text
+void ProfileColumns(const char **pCells, int columns, int rows, int first_value, column_profile *profile)
+{
+	memset(profile, 0, sizeof(column_profile) * columns);
+	for (int r=0; r<rows; r++) {
+		for (int c=0; c<columns; c++) {
+			const char *cell = pCells[r*columns+c];
+			column_profile &col = profile[c];
+			if (!cell || !*cell) {
+				col.empty++;
+				continue;
+			}
+			col.cells++;
+			// isNumeric counts hex digits up to the first character that can't be in a number
+			int letters = 0, length = 0, digits = 0, numeric = 1;
+			bool lead = true, range = false;
+			for (const char *s=cell; char c = *s; s++, length++) {
+				if ((c>='A' && c<='Z') || (c>='a' && c<='z'))
+					letters++;
+				if (c=='t' && s[1]=='o')
+					range = true;
+				if (lead && (c==' ' || c=='\t'))
+					continue;
+				lead = false;
+				if (numeric<0)
+					continue;
+				if ((c>='0' && c<='9') || (c>='a' && c<='f') || (c>='A' && c<='F'))
+					digits++;
+				else if (c!=' ' && c!='\t' && c!='.' && c!='+' && c!='-' && c!='x')
+					numeric = -1;
+			}
+			if (numeric<0)
+				numeric = digits;
+			if (r>=first_value)
+				col.numeric += numeric;
+			if (numeric<2 && length)
+				col.text += (letters * 2) / length;
+			col.ranges += range ? 1 : 0;
+		}
+	}
+}
+
 const char* strlastchar(const char *str, char t, char s)
 {
 	if (!str)
@@ -1079,6 +2288,147 @@ const char* strlastchar(const char *str, char t, char s)
 	return end;
 }
 
+//
+//
+// CELL DECODING
+//
+//
+
+
+inline bool isDigit(char c) { return c>='0' && c<='9'; }
+
+inline int hexDigit(char c)
+{
+	if (c>='0' && c<='9') return c-'0';
+	if (c>='a' && c<='f') return c-'a'+10;
+	if (c>='A' && c<='F') return c-'A'+10;
+	return -1;
+}
+
+// Decimal number at the start of a cell like strtod. Up to 19 significant digits with a small
+// exponent are exact as a single multiply or divide, anything else is left to strtod.
+double ParseNumber(const char *str)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char *s = str;
+	while (*s==' ' || (*s>='\t' && *s<='\r')) s++;
+	bool neg = *s=='-';
+	if (*s=='-' || *s=='+') s++;
+	u64 mant = 0;
+	int sig = 0, exp10 = 0;
+	bool digits = false;
+	for (; isDigit(*s); s++, digits = true) {
+		if (mant || *s!='0') { mant = mant*10 + u64(*s-'0'); sig++; }
+	}
+	if (*s=='.') {
+		for (s++; isDigit(*s); s++, digits = true) {
+			if (mant || *s!='0') { mant = mant*10 + u64(*s-'0'); sig++; }
+			exp10--;
+		}
+	}
+	if (!digits || sig>19 || *s=='x' || *s=='X')
+		return strtod(str, nullptr);	// hex, inf, nan, no number or too many digits
+	if ((*s=='e' || *s=='E') && (isDigit(s[1]) || ((s[1]=='-' || s[1]=='+') && isDigit(s[2])))) {
+		bool eneg = *++s=='-';
+		if (*s=='-' || *s=='+') s++;
+		int e = 0;
+		for (; isDigit(*s); s++)
+			if (e<10000) e = e*10 + (*s-'0');
+		exp10 += eneg ? -e : e;
+	}
+	if (!mant)
+		return neg ? -0.0 : 0.0;
+	if (mant>(1ULL<<53) || exp10<-22 || exp10>22)
+		return strtod(str, nullptr);
+	double v = exp10<0 ? double(mant) / pow10[-exp10] : double(mant) * pow10[exp10];
+	return neg ? -v : v;
+}
+
+// hexadecimal digits after optional spaces like strtoll with base 16, end is past the last digit
+u64 ParseHex(const char *str, const char **end)
+{
+	while (*str==' ') str++;
+	u64 v = 0;
+	for (int d; (d = hexDigit(*str))>=0; str++)
+		v = (v<<4) | u64(d);
+	*end = str;
+	return v;
+}
+
+// decimal digits after optional spaces
+int ParseDecimal(const char *str)
+{
+	while (*str==' ') str++;
+	int v = 0;
+	for (; isDigit(*str); str++)
+		v = v*10 + (*str-'0');
+	return v;
+}
+
+// second value of a range like "1 to 10" or nullptr if not a range
+inline const char* FindRangeTo(const char *cell)
+{
+	for (; *cell; cell++)
+		if (cell[0]=='t' && cell[1]=='o')
+			return cell;
+	return nullptr;
+}
+
+// colour names are matched by prefix, each prefix has a unique slot in a hash table built at compile time
+#define COLOR_HASH_SIZE 128
+#define COLOR_HASH_SEED 5286
+#define COLOR_NAME_MAX 6
+
+constexpr unsigned int ColorNameHash(const char *name, int len)
+{
+	unsigned int h = COLOR_HASH_SEED;
+	for (int i=0; i<len; i++)
+		h = (h ^ (unsigned int)(name[i]|0x20)) * 16777619U;
+	return (h>>24) & (COLOR_HASH_SIZE-1);
+}
+
+constexpr int ColorNameLength(const char *name)
+{
+	int len = 0;
+	while (name[len]) len++;
+	return len;
+}
+
+struct color_name_hash {
+	signed char slot[COLOR_HASH_SIZE];
+	bool perfect;
+
+	constexpr color_name_hash() : slot(), perfect(true)
+	{
+		for (int s=0; s<COLOR_HASH_SIZE; s++)
+			slot[s] = -1;
+		for (int n=0; n<num_colornames; n++) {
+			unsigned int s = ColorNameHash(colornames[n].name, ColorNameLength(colornames[n].name));
+			if (slot[s]>=0)
+				perfect = false;
+			slot[s] = (signed char)n;
+		}
+	}
+};
+
+static constexpr color_name_hash colornames_hash;
+static_assert(colornames_hash.perfect, "colour names collide in the hash table, pick another COLOR_HASH_SEED");
+
+// index of the longest colour name that starts the string or -1
+int FindColorName(const char *val)
+{
+	int len = 0;
+	while (len<COLOR_NAME_MAX && val[len]) len++;
+	for (; len>=2; len--) {
+		int n = colornames_hash.slot[ColorNameHash(val, len)];
+		if (n>=0 && colornames[n].name[len]==0 && strncasecmp(val, colornames[n].name, len)==0)
+			return n;
+	}
+	return -1;
+}
+
 //
 //
 // COLOR PARSING
@@ -1088,19 +2438,19 @@ const char* strlastchar(const char *str, char t, char s)
 
 color read_col(const char *val)
 {
-	char *end;
+	const char *end;
 	if (val!=nullptr) {
 		if (val[0]=='0' && (val[1]=='x' || val[1]=='X'))
 			val += 2;
 		else if (val[0]=='#')
 			val++;
-		if (isHexOrDec(val)) {
-			unsigned long v = (unsigned long)strtoll(val, &end, 16);
+		u64 v = ParseHex(val, &end);
+		if (*end==' ' || *end==0) { // only hex digits
 			int chars = (int)(end-val);
 			if (chars==1)
 				return c64[v&15];
 			if (chars==2 && v<=0x15) // interpret as decimal c64 color
-				return c64[strtol(val, &end, 10)&15];
+				return c64[ParseDecimal(val)&15];
 			if (chars<=4) { // amiga color
 				u8 a = ((v>>8)&0xf0) | ((v>>12)&0x0f), b = ((v>>4)&0xf0) | ((v>>8)&0x0f);
 				u8 c = ((v)&0xf0) | ((v>>4)&0x0f), d = ((v<<4)&0xf0) | ((v)&0x0f);
@@ -1111,9 +2461,9 @@ color read_col(const char *val)
 			if (chars<=6) { color ret = { (u8)(v>>16), (u8)(v>>8), (u8)v, 255 }; return ret; }
 			color ret = { (u8)(v>>24), (u8)(v>>16), (u8)(v>>8), (u8)v }; return ret;
 		} else {
-			for (int c=0; c<num_colornames; c++)
-				if (strncasecmp(val, colornames[c].name, strlen(colornames[c].name))==0)
-					return colornames[c].col;
+			int c = FindColorName(val);
+			if (c>=0)
+				return colornames[c].col;
 		}
 	}
 	color ret = { 0, 0, 0, 255 };
@@ -1123,16 +2473,27 @@ color read_col(const char *val)
 
 // ARGUMENTS PASSED IN TO THE PROGRAM
 
+#define MAX_DATA_ARGS 64
+
+struct preset_cache;
+
 struct Flora {
-	const char *data_file, *out_file, *background_file;
-	const char *preset_str, *data_str, *extra_str, *font_name;
+	const char *data_file, *out_file, *background_file, *compile_file, *batch_file, *serve_addr, *stats_file;
+	string_table strings;	// names, values and arguments read from csv files
+	arena memory;			// flowers, presets, bitmap and temporaries of the run
+	const char *font_name;
 	const char *title_str;
 	fit shape;
 	sort order;
+	aggregate aggregate_op;
+	const char *aggregate_column;
+	int top_count;
+	int top_bins;
+	u64 seed;
 	int img_widhgt;
 	double aspect;
-	flower *presets;
-	flower_pack *preset_packs;
+	const flower_spec *presets;
+	const flower_pack *preset_packs;
 	int num_presets;
 	int legend_height;
 	int title_height;
@@ -1142,20 +2503,45 @@ struct Flora {
 	color name_color;
 	int user_args;
 	int data_found;
+	int num_data_args;
+	const char *data_args[MAX_DATA_ARGS*2];	// argument rows read from the csv file
 	bool legend_inside;
+	bool reading_data_file;	// argument rows may name another data file once
+	bool no_files;			// arguments from a request may not name files on this machine
+	bool rendered;			// a run renders once
+	FILE *messages;			// progress and diagnostics, nullptr for silence
+	font_state font;
+	font_cache *fonts;		// fonts kept loaded between runs, nullptr loads the font for the run
+	preset_cache *preset_files;	// same for preset files
+	run_stats stats;
+	run_progress progress;	// reported while rendering, can be cancelled from any thread
+	const char *data_text;	// csv text in memory instead of data_file
+	size_t data_text_size;
+	const char **data_cells;	// or a table of cells in memory, first row is titles
+	int data_columns, data_rows;
+	unsigned int *bitmap;	// result of Render, lives until EndRun
+	int img_wid, img_hgt;
+	char out_file_buf[512];
+	char title_buf[128];
 	
 	
 	Flora() :
 	data_file(nullptr),
 	out_file(nullptr),
 	background_file(nullptr),
-	preset_str(nullptr),
-	data_str(nullptr),
-	extra_str(nullptr),
+	compile_file(nullptr),
+	batch_file(nullptr),
+	serve_addr(nullptr),
+	stats_file(nullptr),
 	font_name(font_file),
 	title_str(nullptr),
 	shape(FIT_ROUND),
 	order(SORT_ORIG),
+	aggregate_op(AGG_NONE),
+	aggregate_column(nullptr),
+	top_count(0),
+	top_bins(1),
+	seed(0),
 	img_widhgt(8192),
 	aspect(16.0/9.0),
 	presets(nullptr),
@@ -1166,7 +2552,22 @@ struct Flora {
 	random_flowers(0),
 	user_args(0),
 	data_found(0),
-	legend_inside(false)
+	num_data_args(0),
+	legend_inside(false),
+	reading_data_file(false),
+	no_files(false),
+	rendered(false),
+	messages(stdout),
+	fonts(nullptr),
+	preset_files(nullptr),
+	data_text(nullptr),
+	data_text_size(0),
+	data_cells(nullptr),
+	data_columns(0),
+	data_rows(0),
+	bitmap(nullptr),
+	img_wid(0),
+	img_hgt(0)
 	{
 		color bg = { 255, 255, 255, 255 };
 		color fg = { 0, 0, 0, 255 };
@@ -1177,8 +2578,26 @@ struct Flora {
 	}
 	
 	int Do();
+	int Batch(int argc, const char *const *argv);
+	int Serve(int argc, const char *const *argv);
+	int Render();
+	bool Encode(const char *format, stbi_write_func *func, void *context);
+	bool Save();
+	bool WriteStats();
+	void EndRun();
 	bool Argument(const char *command, const char *arg=nullptr, bool full=false);
-} flora;
+	void Message(const char *format, ...);
+};
+
+void Flora::Message(const char *format, ...)
+{
+	if (messages) {
+		va_list args;
+		va_start(args, format);
+		vfprintf(messages, format, args);
+		va_end(args);
+	}
+}
 
 
 
@@ -1188,10 +2607,10 @@ struct Flora {
 //
 //
 
-int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flower_pack &low_p, flower_pack &high_p)
+int GetRange(const char *cell, ColumnIndex type, flower_spec &low, flower_spec &high, flower_pack &low_p, flower_pack &high_p, int data_found)
 {
 	while (cell && *cell==' ') cell++;
-	const char *val2 = strstr(cell, "to");
+	const char *val2 = FindRangeTo(cell), *hex_end;
 	if (!val2)
 		val2 = cell;
 	else {
@@ -1202,13 +2621,13 @@ int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flow
 	switch (type) {
 		case CLN_VALUE:
 			if (cell[0]=='0' && tolower(cell[1])=='x')
-				low_p.r = sqrt(double(strtol(cell,NULL, 16)));
+				low_p.r = sqrt(double(ParseHex(cell+2, &hex_end)));
 			else
-				low_p.r = sqrt(strtod(cell, nullptr));	// area is value
+				low_p.r = sqrt(ParseNumber(cell));	// area is value
 			if (val2[0]=='0' && tolower(val2[1])=='x')
-				high_p.r = sqrt(double(strtol(val2,NULL, 16)));
+				high_p.r = sqrt(double(ParseHex(val2+2, &hex_end)));
 			else
-				high_p.r = sqrt(strtod(val2, nullptr));
+				high_p.r = sqrt(ParseNumber(val2));
 			low.value = cell;
 			high.value = val2;
 			break;
@@ -1219,30 +2638,30 @@ int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flow
 			break;
 			
 		case CLN_CENTER:
-			low.c = 0.01 * strtod(cell, nullptr);	// center is a percentage scalar of radius here
-			high.c = 0.01 * strtod(val2, nullptr);
+			low.c = 0.01 * ParseNumber(cell);	// center is a percentage scalar of radius here
+			high.c = 0.01 * ParseNumber(val2);
 			break;
 			
 		case CLN_ANGLE:
-			low.a = strtod(cell, nullptr);
-			high.a = strtod(val2, nullptr);
+			low.a = ParseNumber(cell);
+			high.a = ParseNumber(val2);
 			break;
 			
 		case CLN_PETAL:
-			low.k = 0.01*strtod(cell, nullptr);	// convert percent
-			high.k = 0.01*strtod(val2, nullptr);
+			low.k = 0.01*ParseNumber(cell);	// convert percent
+			high.k = 0.01*ParseNumber(val2);
 			break;
 			
 		case CLN_COLPETAL:
 			low.col_pet = read_col(cell);
 			high.col_pet = read_col(val2);
-			if (!(flora.data_found&(1<<CLN_LINPETAL)))
+			if (!(data_found&(1<<CLN_LINPETAL)))
 				low.lin_pet = 128; // if setting color and not linear probably implying slightly linear interp
 			break;
 			
 		case CLN_LINPETAL:
-			low.lin_pet = (u8)(2.55 * strtod(cell, nullptr));
-			high.lin_pet = (u8)(2.55 * strtod(cell, nullptr));
+			low.lin_pet = (u8)(2.55 * ParseNumber(cell));
+			high.lin_pet = (u8)(2.55 * ParseNumber(cell));
 			break;
 			
 		case CLN_COLCTR:
@@ -1252,13 +2671,13 @@ int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flow
 			break;
 			
 		case CLN_LINCTR:
-			low.lin_ctr = (u8)(2.55 * strtod(cell, nullptr));
-			high.lin_ctr = (u8)(2.55 * strtod(cell, nullptr));
+			low.lin_ctr = (u8)(2.55 * ParseNumber(cell));
+			high.lin_ctr = (u8)(2.55 * ParseNumber(cell));
 			break;
 			
 		case CLN_FLAT:
-			low.f = strtod(cell, nullptr);
-			high.f = strtod(cell, nullptr);
+			low.f = ParseNumber(cell);
+			high.f = ParseNumber(cell);
 			break;
 			
 		case CLN_TYPE:
@@ -1279,6 +2698,19 @@ int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flow
 	return 0;
 }
 
+// number in a value cell, the middle of a range
+double CellValue(const char *cell)
+{
+	while (*cell==' ') cell++;
+	const char *hex_end;
+	double v = (cell[0]=='0' && tolower(cell[1])=='x') ? double(ParseHex(cell+2, &hex_end)) : ParseNumber(cell);
+	if (const char *val2 = FindRangeTo(cell)) {
+		for (val2 += 2; *val2 && *val2<=' '; val2++);
+		v = 0.5 * (v + CellValue(val2));
+	}
+	return v;
+}
+
 
 //
 //
@@ -1287,69 +2719,603 @@ int GetRange(const char *cell, ColumnIndex type, flower &low, flower &high, flow
 //
 
 
-// parse a CSV file into a 2D array of char pointers. returns nullptr if invalid or can't open, 3 mallocs.
-const char** ReadCSV(const char *filename, int &columns, int &rows, const char** memory)
+// one bit per byte of a 64 byte block for each character the CSV tokenizer cares about
+struct csv_block { u64 quote, comma, line, zero; };
+
+inline int bitscan(u64 bits)
 {
-	size_t s;
-	*memory = nullptr;
-	if (char *CSV = ReadFile(filename, s)) {
-		char *CSVStart = ((u8)CSV[0]==0xef&&(u8)CSV[1]==0xbb&&(u8)CSV[2]==0xbf)?CSV+3:CSV;
-		const char *p = CSVStart;
-		size_t l = s;
-		bool q = false, e=true, f=true;
-		int n = 0, cl=0, rw=0, z=0;	// count columns, rows and bytes for strings.
-		while (l) {
-			char c = *p++;
-			l--;
-			if (e && c>' ') e = false;
-			switch (c) {
-				case 0: return nullptr;
-				case '"': if (f) { q=!q; f=!f; } else if (q) {
-					if (*p==c && l) { z++; p++; l--; } else q = false; } break;
-				case ',': if (!q) { n++; e=true; f=true; z++; } break;
-				case '\r':
-				case '\n': if (q) break; if (n|!f) { n++; z++;
-					if (n>cl) cl=n; rw++; n=0; f=true; } break;
-				default: z++; f = false; break;
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward64(&i, bits);
+	return (int)i;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+inline int bitscan_reverse(u64 bits)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanReverse64(&i, bits);
+	return (int)i;
+#else
+	return 63 - __builtin_clzll(bits);
+#endif
+}
+
+// each bit is set if an odd number of bits are set at or below it, the inside of quotes
+inline u64 prefix_xor(u64 bits)
+{
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
+
+csv_block ScanCSVBlock(const char *text, size_t left)
+{
+	char tail[64];
+	if (left<64) {	// pad the end of the text with something harmless
+		memcpy(tail, text, left);
+		memset(tail+left, ' ', 64-left);
+		text = tail;
+	}
+	csv_block b = { 0, 0, 0, 0 };
+#ifdef CSV_SSE2
+	const __m128i quote = _mm_set1_epi8('"'), comma = _mm_set1_epi8(','), zero = _mm_setzero_si128();
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+	for (int i=0; i<64; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(text+i));
+		b.quote |= u64((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote))) << i;
+		b.comma |= u64((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma))) << i;
+		b.line |= u64((u32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)))) << i;
+		b.zero |= u64((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) << i;
+	}
+#else
+	for (int i=0; i<64; i++) {
+		u64 bit = 1ULL << i;
+		switch (text[i]) {
+			case '"': b.quote |= bit; break;
+			case ',': b.comma |= bit; break;
+			case '\r':
+			case '\n': b.line |= bit; break;
+			case 0: b.zero |= bit; break;
+		}
+	}
+#endif
+	return b;
+}
+
+// cells of tokenized CSV rows, rows can have different numbers of cells
+struct csv_rows {
+	const char **cells;
+	int *row_end;		// index in cells past the last cell of each row
+	int num_cells, num_rows;
+	int cap_cells, cap_rows;
+	int columns;		// most cells in any row
+
+	csv_rows() : cells(nullptr), row_end(nullptr), num_cells(0), num_rows(0), cap_cells(0), cap_rows(0), columns(0) {}
+	~csv_rows() { free(cells); free(row_end); }
+
+	void add_cell(const char *cell)
+	{
+		if (num_cells==cap_cells) {
+			cap_cells = cap_cells ? cap_cells*2 : 1024;
+			cells = (const char**)realloc(cells, sizeof(const char*) * cap_cells);
+		}
+		cells[num_cells++] = cell;
+	}
+
+	void end_row()
+	{
+		if (num_rows==cap_rows) {
+			cap_rows = cap_rows ? cap_rows*2 : 256;
+			row_end = (int*)realloc(row_end, sizeof(int) * cap_rows);
+		}
+		int first = num_rows ? row_end[num_rows-1] : 0;
+		if ((num_cells-first)>columns)
+			columns = num_cells-first;
+		row_end[num_rows++] = num_cells;
+	}
+
+	int row_start(int row) const { return row ? row_end[row-1] : 0; }
+	void clear() { num_cells = num_rows = columns = 0; }
+};
+
+// Returns the inside of quotes in a block. Like the original reader a quote only opens at the very
+// start of a cell, inside of quotes every quote counts and one right after a closing quote is an
+// escaped "". Other quotes are stray and belong to the cell. in_quote and lead (the last byte ended
+// a cell or closed a quote) carry over to the next block.
+inline u64 CSVInside(const csv_block &b, u64 &in_quote, u64 &lead)
+{
+	u64 quotes = 0, start = ((b.comma | b.line) << 1) | lead;
+	bool q = in_quote!=0;
+	for (u64 bits = b.quote; bits; bits &= bits-1) {
+		u64 bit = bits & (0-bits);
+		if (q || (start & bit)) {
+			quotes |= bit;
+			start |= bit << 1;
+			q = !q;
+		}
+	}
+	u64 inside = prefix_xor(quotes) ^ in_quote;
+	in_quote = (u64)((long long)inside >> 63);
+	lead = ((b.comma | b.line | quotes) >> 63) & 1;
+	return inside;
+}
+
+// returns the number of bytes in text up to and including the last line break outside of quotes
+size_t CSVCompleteRows(const char *text, size_t size)
+{
+	size_t complete = 0;
+	u64 in_quote = 0, lead = 1;
+	for (size_t o=0; o<size; o+=64) {
+		csv_block b = ScanCSVBlock(text+o, size-o);
+		u64 inside = CSVInside(b, in_quote, lead);
+		if (u64 lines = b.line & ~inside)
+			complete = o + bitscan_reverse(lines) + 1;
+	}
+	return complete;
+}
+
+// quote state between bytes for CSVInside, bit 1 inside of quotes and bit 0 lead
+#define CSV_LEAD 1
+#define CSV_QUOTE 2
+#define CSV_STATES 4
+
+// returns the offset of the row following offset from in the quote state at from
+size_t CSVNextRow(const char *text, size_t from, size_t size, int state)
+{
+	u64 in_quote = (state & CSV_QUOTE) ? ~0ULL : 0, lead = state & CSV_LEAD;
+	for (size_t o=from; o<size; o+=64) {
+		csv_block b = ScanCSVBlock(text+o, size-o);
+		u64 inside = CSVInside(b, in_quote, lead);
+		u64 lines = b.line & ~inside;
+		if (size-o<64)
+			lines &= (1ULL<<(size-o))-1;
+		if (lines)
+			return o + bitscan(lines) + 1;
+	}
+	return size;
+}
+
+#define CSV_MIN_PART (256<<10)
+
+// split CSV text into ranges that start at rows for parsing in parallel, returns the number of ranges
+int SplitCSV(const char *text, size_t size, size_t *bounds, int max_parts)
+{
+	int parts = (int)(size / CSV_MIN_PART);
+	if (parts>max_parts) parts = max_parts;
+	if (parts<1) parts = 1;
+	bounds[0] = 0;
+	bounds[parts] = size;
+	if (parts==1)
+		return 1;
+	// which quotes count depends on the state before them so each part is scanned in parallel from
+	// every state, chaining the end states then tells which boundaries fall inside quotes
+	u8 next[MAX_THREADS][CSV_STATES];
+	ParallelFor(parts, [&](int p) {
+		size_t end = (p+1)*(size/parts);
+		u64 in_quote[CSV_STATES], lead[CSV_STATES];
+		for (int s=0; s<CSV_STATES; s++) {
+			in_quote[s] = (s & CSV_QUOTE) ? ~0ULL : 0;
+			lead[s] = s & CSV_LEAD;
+		}
+		for (size_t o=p*(size/parts); o<end; o+=64) {
+			csv_block b = ScanCSVBlock(text+o, end-o);
+			for (int s=0; s<CSV_STATES; s++)
+				CSVInside(b, in_quote[s], lead[s]);
+		}
+		for (int s=0; s<CSV_STATES; s++)
+			next[p][s] = (u8)((in_quote[s] ? CSV_QUOTE : 0) | (int)lead[s]);
+	});
+	int state = CSV_LEAD;
+	int split = 1;
+	for (int p=1; p<parts; p++) {
+		state = next[p-1][state];
+		size_t b = CSVNextRow(text, p*(size/parts), size, state);
+		if (b>bounds[split-1] && b<size)
+			bounds[split++] = b;
+	}
+	bounds[split] = size;
+	return split;
+}
+
+// strip quotes and unescape "" of a cell in place, returns the new end. Only a quote that opens
+// the cell starts quoting, stray quotes are dropped like the original reader did.
+char* UnquoteCell(char *cell, char *end, bool open)
+{
+	char *w = cell;
+	bool q = false;
+	for (char *r=cell; r<end; r++) {
+		if (*r=='"') {
+			if (r==cell && open) q = true;
+			else if (q && (r+1)<end && r[1]=='"') { *w++ = '"'; r++; }
+			else q = false;
+		} else
+			*w++ = *r;
+	}
+	return w;
+}
+
+// Split CSV text into zero terminated cells in place. Cells are terminated where their delimiters
+// are so only quoted cells get rewritten. A last row without a line break is terminated at
+// text[size] which must be writable. Returns false if the text is not CSV (zero bytes).
+bool TokenizeCSV(char *text, size_t size, csv_rows &rows)
+{
+	char *cell = text, *end = text + size;
+	bool quoted = false;
+	int row_first = rows.num_cells;
+	u64 in_quote = 0, lead = 1;
+	for (size_t o=0; o<size; o+=64) {
+		csv_block b = ScanCSVBlock(text+o, size-o);
+		if (b.zero & (size-o<64 ? ((1ULL<<(size-o))-1) : ~0ULL))
+			return false;
+		u64 inside = CSVInside(b, in_quote, lead);
+		u64 ends = (b.comma | b.line) & ~inside;
+		u64 bits = ends | b.quote;
+		while (bits) {
+			int i = bitscan(bits);
+			bits &= bits-1;
+			if (!((ends>>i)&1)) {
+				quoted = true;
+				continue;
 			}
+			char *delim = text + o + i;
+			bool open = *cell=='"';
+			while (cell<delim && (u8)*cell<=' ') cell++;
+			char *cell_end = quoted ? UnquoteCell(cell, delim, open) : delim;
+			bool line = (b.line>>i)&1;
+			if (!line || rows.num_cells>row_first || cell_end>cell) {
+				*cell_end = 0;
+				rows.add_cell(cell);
+				if (line) {
+					rows.end_row();
+					row_first = rows.num_cells;
+				}
+			} // else empty line
+			cell = delim + 1;
+			quoted = false;
 		}
-		z++;
-		if (!cl) cl = n;
-		if (n) rw++;	// get room for array and strings and fill it out.
-		char **ret = nullptr;
-		if (cl>0 && rw>0) {
-			ret = (char**)malloc(sizeof(char*) * cl * rw);
-			char **o = ret;
-			char *w=(char*)malloc(z); *memory=w; p = CSVStart; l = s; n = 0; *o++=w;
-			while (l) {
-				char c = *p++;
-				l--;
-				if (e && c>' ') e = false;
-				switch (c) {
-					case 0: return nullptr;
-					case '"': if (f) { q=!q; f=!f; } else if (q) { if (*p==c && l) { *w++=c; p++; l--; } else q = false; } break;
-					case ',': if (!q) { n++; e=true; *w++=0; f=true; if((o-ret)<(cl*rw)) *o++=w; } break;
-					case '\r':
-					case '\n': if (q) break; if (n|!f) { n++; n=0; f=true; *w++=0; if((o-ret)<(cl*rw)) *o++=w; } break;
-					default: if (!e) *w++ = c; f = false; break;
+	}
+	bool open = cell<end && *cell=='"';
+	while (cell<end && (u8)*cell<=' ') cell++;
+	if (rows.num_cells>row_first || cell<end) {
+		char *cell_end = quoted ? UnquoteCell(cell, end, open) : end;
+		*cell_end = 0;
+		rows.add_cell(cell);
+		rows.end_row();
+	}
+	return true;
+}
+
+#ifndef CSV_CHUNK_SIZE
+#define CSV_CHUNK_SIZE (16<<20)
+#endif
+
+// Reads a CSV file a chunk of complete rows at a time so memory use doesn't grow with the file.
+// Mapped files are tokenized in place one window at a time, anything else is read into a buffer.
+// Text in memory is treated like a mapped file and a table of cells is a single chunk.
+// Each chunk is split into parts that are tokenized in parallel.
+struct csv_stream {
+	mapped_file *map;
+	mapped_file text;	// csv text in memory instead of a mapped file
+	FILE *file;
+	char *buf;
+	const char **table;
+	int table_columns, table_rows;
+	size_t buf_size, buf_used, pos, released, streamed;
+	csv_rows parts[MAX_THREADS];	// rows of the current chunk in order, valid until the next chunk is read
+	int num_parts;
+	bool error, started;
+
+	csv_stream() : map(nullptr), file(nullptr), buf(nullptr), table(nullptr), table_columns(0), table_rows(0), buf_size(0), buf_used(0), pos(0), released(0), streamed(0), num_parts(0), error(false), started(false) {}
+	~csv_stream() { close(); }
+
+	int rows() const
+	{
+		int total = 0;
+		for (int p=0; p<num_parts; p++)
+			total += parts[p].num_rows;
+		return total;
+	}
+
+	// bytes of csv read so far and in all, the total is 0 when not known
+	void progress(u64 &done, u64 &total) const
+	{
+		if (map) {
+			done = pos;
+			total = map->size;
+		} else if (table) {
+			done = started ? table_rows : 0;
+			total = table_rows;
+		} else {
+			done = streamed;
+			total = 0;
+		}
+	}
+
+	int columns() const
+	{
+		int most = 0;
+		for (int p=0; p<num_parts; p++)
+			if (parts[p].columns>most) most = parts[p].columns;
+		return most;
+	}
+
+	bool open(const char *filename)
+	{
+		close();
+		if (IsStdStream(filename)) {
+			SetBinaryStream(stdin);
+			file = stdin;
+			buf_size = CSV_CHUNK_SIZE;
+			buf = (char*)malloc(buf_size+1);
+			return buf!=nullptr;
+		}
+		if ((map = MapFile(filename, 1))) {
+			if (map->size>=3 && (u8)map->data[0]==0xef && (u8)map->data[1]==0xbb && (u8)map->data[2]==0xbf)
+				pos = 3;
+			return true;
+		}
+		if ((file = fopen(filename, "rb"))) {
+			buf_size = CSV_CHUNK_SIZE;
+			buf = (char*)malloc(buf_size+1);
+			return buf!=nullptr;
+		}
+		return false;
+	}
+
+	// csv text is copied since it is tokenized in place
+	bool open_text(const char *data, size_t size, arena &memory)
+	{
+		close();
+		text.data = memory.alloc<char>(size+1);
+		text.size = size;
+		memcpy(text.data, data, size);
+		text.data[size] = 0;
+		map = &text;
+		if (size>=3 && (u8)data[0]==0xef && (u8)data[1]==0xbb && (u8)data[2]==0xbf)
+			pos = 3;
+		return true;
+	}
+
+	// rows of cells, the cells must stay valid while reading
+	bool open_table(const char **cells, int columns, int rows)
+	{
+		close();
+		table = cells;
+		table_columns = columns;
+		table_rows = rows;
+		return cells!=nullptr && columns>0;
+	}
+
+	// tokenize the next chunk into rows, returns false at the end of the file or on error
+	bool next()
+	{
+		TRACE_SCOPE("csv_stream::next");
+		for (int p=0; p<num_parts; p++)
+			parts[p].clear();
+		num_parts = 0;
+		if (table) {
+			if (started)
+				return false;
+			started = true;
+			num_parts = Threads().threads()<table_rows ? Threads().threads() : table_rows;
+			for (int p=0; p<num_parts; p++) {
+				for (int r=table_rows*p/num_parts, e=table_rows*(p+1)/num_parts; r<e; r++) {
+					for (int c=0; c<table_columns; c++)
+						parts[p].add_cell(table[r*table_columns+c] ? table[r*table_columns+c] : "");
+					parts[p].end_row();
 				}
 			}
-			*w++=0;
-#ifdef CSV_DEBUG
-			for (int r=0; r<rw; r++) {
-				for (int c=0; c<cl; c++) {
-					printf("%s,", ret[r*cl+c]);
+			return num_parts>0;
+		}
+		char *text = nullptr;
+		size_t len = 0;
+		if (map) {
+			if (map!=&this->text)
+				ReleaseMappedRange(map, released, pos);
+			released = pos;
+			if (pos>=map->size)
+				return false;
+			for (size_t window = CSV_CHUNK_SIZE;; window *= 2) {
+				if (window>=(map->size-pos)) {
+					len = map->size-pos;
+					break;
 				}
-				printf("\n");
+				if ((len = CSVCompleteRows(map->data+pos, window)))
+					break;
+			}
+			text = map->data+pos;
+			pos += len;
+		} else if (file) {
+			// keep the incomplete row at the end of the previous chunk
+			memmove(buf, buf+pos, buf_used-pos);
+			buf_used -= pos;
+			pos = 0;
+			for (;;) {
+				size_t got = fread(buf+buf_used, 1, buf_size-buf_used, file);
+				buf_used += got;
+				streamed += got;
+				if (buf_used<buf_size) {	// end of file
+					len = buf_used;
+					break;
+				}
+				if ((len = CSVCompleteRows(buf, buf_used)))
+					break;
+				buf_size *= 2;	// a single row doesn't fit
+				buf = (char*)realloc(buf, buf_size+1);
+			}
+			if (!len)
+				return false;
+			text = buf;
+			pos = len;
+			if (!started && len>=3 && (u8)buf[0]==0xef && (u8)buf[1]==0xbb && (u8)buf[2]==0xbf) {
+				text += 3;
+				len -= 3;
+			}
+		} else
+			return false;
+		started = true;
+		size_t bounds[MAX_THREADS+1];
+		num_parts = SplitCSV(text, len, bounds, Threads().threads());
+		bool valid[MAX_THREADS];
+		ParallelFor(num_parts, [&](int p) {
+			valid[p] = TokenizeCSV(text+bounds[p], bounds[p+1]-bounds[p], parts[p]);
+		});
+		for (int p=0; p<num_parts; p++) {
+			if (!valid[p]) {
+				error = true;
+				return false;
 			}
-#endif
 		}
-		free(CSV);
-		columns = cl;
-		rows = rw;
-		return (const char**)ret;
+		return true;
 	}
-	return nullptr;
+
+	void close()
+	{
+		if (map) { if (map!=&text) UnmapFile(map); map = nullptr; }
+		if (file) { if (file!=stdin) fclose(file); file = nullptr; }
+		if (buf) { free(buf); buf = nullptr; }
+		table = nullptr;
+		table_columns = table_rows = 0;
+		buf_size = buf_used = pos = released = 0;
+		for (int p=0; p<num_parts; p++)
+			parts[p].clear();
+		num_parts = 0;
+		error = started = false;
+	}
+};
+
+
+//
+//
+// KEEP LARGEST FLOWERS
+//
+//
+
+
+// flowers beyond the largest are summed up by powers of two of their area
+#define OTHER_BUCKETS 128
+#define OTHER_MAX_BINS 16
+#define TOP_MAX (1<<29)	// most flowers top keeps, leaves room for the other flowers in an int
+#define ROW_VALUE 0x80000000	// with top the value of a flower is the row of the chunk until it is kept
+
+struct other_flowers {
+	double area[OTHER_BUCKETS], low[OTHER_BUCKETS], high[OTHER_BUCKETS];
+	int count[OTHER_BUCKETS];
+	int total;
+
+	other_flowers() { memset(this, 0, sizeof(other_flowers)); }
+
+	void add(double r)
+	{
+		double a = r*r;
+		int e = 0;
+		frexp(a, &e);
+		int b = e + OTHER_BUCKETS/2;
+		b = b<0 ? 0 : (b>=OTHER_BUCKETS ? OTHER_BUCKETS-1 : b);
+		if (!count[b] || a<low[b]) low[b] = a;
+		if (!count[b] || a>high[b]) high[b] = a;
+		area[b] += a;
+		count[b]++;
+		total++;
+	}
+};
+
+static bool larger_pack(const flower_pack *packs, int a, int b)
+{
+	return packs[a].r>packs[b].r || (packs[a].r==packs[b].r && a<b);
+}
+
+// keep the largest flowers in their original order and add the rest to other
+void KeepLargestFlowers(flower *flowers, flower_pack *packs, int &count, int keep, other_flowers &other, arena &memory)
+{
+	if (count<=keep)
+		return;
+	// min heap of the largest flowers so far, the smallest of them on top
+	arena::mark temp = memory.get_mark();
+	int *heap = memory.alloc<int>(keep);
+	int size = 0;
+	for (int n=0; n<count; n++) {
+		int i = n;
+		if (size<keep) {
+			int c = size++;
+			while (c && larger_pack(packs, heap[(c-1)/2], i)) { heap[c] = heap[(c-1)/2]; c = (c-1)/2; }
+			heap[c] = i;
+			continue;
+		}
+		if (keep && larger_pack(packs, i, heap[0])) {
+			int smallest = heap[0];
+			int c = 0;
+			for (;;) {
+				int s = c*2+1;
+				if (s>=size) break;
+				if ((s+1)<size && larger_pack(packs, heap[s], heap[s+1])) s++;
+				if (!larger_pack(packs, i, heap[s])) break;
+				heap[c] = heap[s];
+				c = s;
+			}
+			heap[c] = i;
+			i = smallest;
+		}
+		other.add(packs[i].r);
+	}
+	qsort(heap, size, sizeof(int), [](const void *a, const void *b) { return *(const int*)a - *(const int*)b; });
+	for (int k=0; k<size; k++) {
+		flowers[k] = flowers[heap[k]];
+		packs[k] = packs[heap[k]];
+	}
+	count = size;
+	memory.release(temp);
+}
+
+// append the flowers that represent all the others, returns the new count
+int AddOtherFlowers(flower *flowers, flower_pack *packs, int count, int bins, const other_flowers &other, string_table &strings, u64 seed)
+{
+	int first = 0, last = OTHER_BUCKETS-1;
+	while (first<OTHER_BUCKETS && !other.count[first]) first++;
+	while (last>first && !other.count[last]) last--;
+	if (first>=OTHER_BUCKETS)
+		return count;
+	bins = bins<1 ? 1 : (bins>OTHER_MAX_BINS ? OTHER_MAX_BINS : bins);
+	int span = last-first+1;
+	for (int bin=0; bin<bins; bin++) {
+		int b0 = first + span*bin/bins, b1 = first + span*(bin+1)/bins;
+		double area = 0.0, low = 0.0, high = 0.0;
+		int num = 0;
+		for (int b=b0; b<b1; b++) if (other.count[b]) {
+			if (!num || other.low[b]<low) low = other.low[b];
+			if (!num || other.high[b]>high) high = other.high[b];
+			area += other.area[b];
+			num += other.count[b];
+		}
+		if (!num)
+			continue;
+		char text[64];
+		flower &f = flowers[count];
+		flower_pack &fp = packs[count];
+		rng random(seed, RNG_OTHER, bin);
+		initflower(random, &f, &fp, default_low, default_low, default_low_pack, default_low_pack);
+		color pet = { 0x90, 0x90, 0x90, 0xff }, ctr = { 0x60, 0x60, 0x60, 0xff };
+		f.col_pet = pet;
+		f.col_ctr = ctr;
+		if (bins>1)
+			sprintf(text, "other %g to %g", low, high);
+		else
+			sprintf(text, "other");
+		f.name = strings.intern(text);
+		sprintf(text, "%d more", num);
+		f.value = strings.add(text);
+		fp.r = sqrt(area);
+		count++;
+	}
+	return count;
 }
 
 
@@ -1360,34 +3326,71 @@ const char** ReadCSV(const char *filename, int &columns, int &rows, const char**
 //
 
 
-flower* readValuesFromCSV(const char *filename, bool range, int &count, const char **mem, flower_pack **ppFP,
-						  flower *presets=nullptr, flower_pack *preset_packs=nullptr, int num_presets=0)
+// gather the cells of a row padded with empty cells up to columns
+inline void GetRow(const csv_rows &rows, int r, const char **cells, int columns)
 {
-	int columns, rows;
-	const char *CSV;
-	flower *flowers = nullptr, *f = nullptr;
-	flower_pack *flower_packs = nullptr, *fp = nullptr;
-	if (const char** pCells = ReadCSV(filename, columns, rows, &CSV)) {
-		if (columns && rows) { // top row will contain the names of relevant elements
+	int c = rows.row_start(r), e = rows.row_end[r];
+	for (int o=0; o<columns; o++)
+		cells[o] = c<e ? rows.cells[c++] : "";
+}
+
+// flowers of a data file or low and high ranges of a preset file when ppR is given,
+// without a filename the csv text or table of cells in flora is read
+static void readFlowersFromCSV(Flora &flora, const char *filename, int &count, string_table &strings, arena &memory,
+							   flower **ppF, flower_spec **ppR, flower_pack **ppFP,
+							   const flower_spec *presets, const flower_pack *preset_packs, int num_presets)
+{
+	TRACE_SCOPE("ReadCSV");
+	const bool range = ppR!=nullptr;
+	flower *flowers = nullptr;
+	flower_spec *ranges = nullptr;
+	flower_pack *flower_packs = nullptr;
+	csv_stream csv;
+	bool opened = filename ? csv.open(filename) : (flora.data_cells ?
+		csv.open_table(flora.data_cells, flora.data_columns, flora.data_rows) :
+		(flora.data_text && csv.open_text(flora.data_text, flora.data_text_size, memory)));
+	// the first chunk of rows decides arguments, columns and guesses
+	if (opened && csv.next()) {
+		int columns = csv.columns(), rows = csv.rows();
+		const char** pCells = memory.alloc<const char*>(columns * rows);
+		for (int p=0, r=0; p<csv.num_parts; p++) {
+			for (int pr=0; pr<csv.parts[p].num_rows; pr++, r++)
+				GetRow(csv.parts[p], pr, pCells + r*columns, columns);
+		}
+#ifdef CSV_DEBUG
+		for (int r=0; r<rows; r++) {
+			for (int c=0; c<columns; c++) {
+				flora.Message("%s,", pCells[r*columns+c]);
+			}
+			flora.Message("\n");
+		}
+#endif
+		{ // top row will contain the names of relevant elements
 			int start_row = 0, top_row = 0; // where the values start
 			
 			if (!range) {
 				// Allow for command line arguments to be rows at start of CSV (may require
 				//	recursion due to re-specification of the data file)
-				static bool recursed = false;
-				if (!recursed) {
+				if (!flora.reading_data_file) {
+					const char *reading = flora.data_file;
 					for (int r=0; r<rows; r++) {
-						if (!flora.Argument(pCells[r*columns], pCells[r*columns+1], true)) {
+						const char *arg = strings.keep(columns>1 ? pCells[r*columns+1] : "");
+						if (!flora.Argument(pCells[r*columns], arg, true)) {
 							start_row = top_row = r;
 							break;
 						}
+						if (flora.num_data_args<MAX_DATA_ARGS && !RunArgument(ArgumentIndex(pCells[r*columns]))) {
+							flora.data_args[flora.num_data_args*2] = strings.keep(pCells[r*columns]);
+							flora.data_args[flora.num_data_args*2+1] = arg;
+							flora.num_data_args++;
+						}
 					}
-					if (flora.data_file!=filename && strcasecmp(flora.data_file, filename)!=0) {
-						recursed = true;
-						flora.extra_str = CSV;
-						flower *ret = readValuesFromCSV(flora.data_file, false, count, mem, ppFP);
-						recursed = false;
-						return ret;
+					if (flora.data_file && flora.data_file!=reading && (!reading || strcasecmp(flora.data_file, reading)!=0)) {
+						csv.close();
+						flora.reading_data_file = true;
+						readFlowersFromCSV(flora, flora.data_file, count, strings, memory, ppF, nullptr, ppFP, nullptr, nullptr, 0);
+						flora.reading_data_file = false;
+						return;
 					}
 				}
 			}
@@ -1397,6 +3400,18 @@ flower* readValuesFromCSV(const char *filename, bool range, int &count, const ch
 				if (strcasecmp(ColumnName[n], (const char*)pCells[c+start_row*columns])==0) {
 					top_row=start_row+1; indices[n] = c; if (!range) flora.data_found |= 1<<n; break;
 				}
+			}
+			column_profile *profile = nullptr;
+			if (!range && (indices[CLN_VALUE]<0 || indices[CLN_NAME]<0)) {
+				flora.stats.begin(PHASE_INFER);
+				profile = memory.alloc<column_profile>(columns);
+				ProfileColumns(pCells, columns, rows, top_row, profile);
+				flora.stats.end(PHASE_INFER);
+#ifdef CSV_DEBUG
+				for (int c=0; c<columns; c++)
+					flora.Message("column %d: %d cells, %d empty, %d numeric, %d text, %d ranges\n", c,
+						   profile[c].cells, profile[c].empty, profile[c].numeric, profile[c].text, profile[c].ranges);
+#endif
 			} // if no value column was found, make a guess
 			if (!range && indices[CLN_VALUE]<0 && indices[CLN_LENGTH]>=0) {
 				indices[CLN_VALUE] = indices[CLN_LENGTH];
@@ -1405,72 +3420,535 @@ flower* readValuesFromCSV(const char *filename, bool range, int &count, const ch
 			} else if (!range && indices[CLN_VALUE]<0) {
 				int bestRowNums = -1;
 				for (int c=0; c<columns; c++) if (!isOneOf(c, indices, CLN_ENTRIES)) {
-					int numNums = 0;
-					for (int r=top_row; r<rows; r++) numNums += isNumeric(pCells[r*columns+c]);
-					if (numNums>bestRowNums) {
-						bestRowNums = numNums; indices[CLN_VALUE] = c; flora.data_found |= 1<<CLN_VALUE;
+					if (profile[c].numeric>bestRowNums) {
+						bestRowNums = profile[c].numeric; indices[CLN_VALUE] = c; flora.data_found |= 1<<CLN_VALUE;
 					}
 				}
 			} // if no name columns was found, make a guess
 			if (!range && indices[CLN_NAME]<0) {
 				int bestText = -1, bestTextCol = -1;
 				for (int c=0; c<columns; c++) if (!isOneOf(0, indices, CLN_ENTRIES)) {
-					int score = columnTextScore(pCells, c, columns, rows);
-					if (score>bestText) { bestText=score; bestTextCol = c; };
+					if (profile[c].text>bestText) { bestText=profile[c].text; bestTextCol = c; };
 				}
 				indices[CLN_NAME] = bestTextCol; flora.data_found |= bestTextCol>=0 ? (1U<<CLN_NAME) : 0;
 			}
+			// rows are combined by the name column unless another column is given by title or number
+			int group_col = -1;
+			if (!range && flora.aggregate_op!=AGG_NONE) {
+				group_col = indices[CLN_NAME];
+				if (const char *col = flora.aggregate_column) {
+					group_col = -1;
+					if (isDigit(*col))
+						group_col = atoi(col)>0 && atoi(col)<=columns ? atoi(col)-1 : -1;
+					else for (int c=0; c<columns && group_col<0; c++) {
+						if (start_row<rows && strcasecmp(pCells[start_row*columns+c], col)==0) {
+							group_col = c;
+							top_row = start_row+1;
+						}
+					}
+				}
+				if (group_col<0)
+					flora.Message("No column to aggregate by\n");
+				else if (group_col!=indices[CLN_NAME])
+					flora.data_found |= 1<<CLN_NAME;	// group names are shown instead
+			}
+			const bool aggregating = !range && flora.aggregate_op!=AGG_NONE && group_col>=0;
+			const int name_col = aggregating ? group_col : indices[CLN_NAME];
 			if (notOneOf(-1, indices, CLN_ENTRIES)) { // any meaningful columns ?
-				int flowersToCreate = 0; // count meaningful rows
-				for (int r=top_row; r<rows; r++)
-					flowersToCreate += rowIsMeaningful(pCells+r*columns, columns, indices[CLN_VALUE], indices[CLN_COUNT]);
-				if (flowersToCreate) {
-					flowers = f = (flower*)malloc(sizeof(flower) * flowersToCreate * (range ? 2:1));
-					flower_packs = fp = (flower_pack*)malloc(sizeof(flower_pack) * flowersToCreate * (range ? 2:1));
-					int n = 0;
-					int *preset_selected = (int*)malloc(sizeof(int) * flowersToCreate);
-					for (int r=top_row; r<rows; r++) {
-						if (rowIsMeaningful(pCells+r*columns, columns, indices[CLN_VALUE], indices[CLN_COUNT])) {
-							int preset = n&&num_presets?(preset_selected[n-1]+1)%num_presets : 0;
-							const char **currRow = pCells+r*columns;
-							if (indices[CLN_NAME]>=0 && currRow[indices[CLN_NAME]] && *currRow[indices[CLN_NAME]]) {
-								for (int c=0; c<n; c++) {
-									if (flowers[c].name && strcasecmp(flowers[c].name, currRow[indices[CLN_NAME]])==0) {
-										preset = preset_selected[c];
-										break;
+				int n = 0, capacity = 0, aggregated_rows = 0;
+				int *preset_selected = nullptr;
+				int *row_copies = nullptr, *row_slot = nullptr, row_capacity = 0;
+				double *row_value = nullptr, *group_value = nullptr;
+				int *group_rows = nullptr;
+				string_pool part_strings[MAX_THREADS];
+				int *preset_of = nullptr, preset_of_size = 0;	// preset of each group of names
+				const char **part_rows = memory.alloc<const char*>(columns * MAX_THREADS);	// cells of the current row of each part
+				int next_preset = 0;	// presets are picked in turn for new names
+				other_flowers other;	// flowers that are not among the top
+				const int top = range ? 0 : flora.top_count;
+				name_map groups;	// flower of each aggregated group, names that only differ in case share one
+				int skip_rows = top_row;	// arguments and titles in the first chunk
+				int rows_read = 0;			// rows in earlier chunks
+				u64 read_bytes = 0, total_bytes = 0;	// progress through the csv
+				do {
+					int part_row[MAX_THREADS+1];
+					part_row[0] = 0;
+					for (int p=0; p<csv.num_parts; p++)
+						part_row[p+1] = part_row[p] + csv.parts[p].num_rows;
+					if (part_row[csv.num_parts]>row_capacity) {	// contents are per chunk, no need to keep them
+						row_capacity = part_row[csv.num_parts];
+						row_copies = memory.alloc<int>(row_capacity);
+						row_slot = memory.alloc<int>(row_capacity);
+						if (aggregating)
+							row_value = memory.alloc<double>(row_capacity);
+					}
+
+					// count the flowers of each row, the radius doesn't depend on presets so tiny ones can be skipped here
+					ParallelFor(csv.num_parts, [&](int p) {
+						const char **currRow = part_rows + p*columns;
+						for (int r=0; r<csv.parts[p].num_rows; r++) {
+							int copies = 0;
+							if ((part_row[p]+r)>=skip_rows) {
+								GetRow(csv.parts[p], r, currRow, columns);
+								if (aggregating) { // every row adds to its group, tiny groups are removed when done
+									if (rowIsMeaningful(currRow, columns, indices[CLN_VALUE], -1)) {
+										row_value[part_row[p]+r] = CellValue(currRow[indices[CLN_VALUE]]);
+										copies = 1;
 									}
+								} else if (rowIsMeaningful(currRow, columns, indices[CLN_VALUE], indices[CLN_COUNT])) {
+									flower_spec l = default_low, h = default_high;
+									flower_pack lp = default_low_pack, hp = default_high_pack;
+									GetRange(currRow[indices[CLN_VALUE]], CLN_VALUE, l, h, lp, hp, flora.data_found);
+									int v = indices[CLN_COUNT]>=0 ? GetRange(currRow[indices[CLN_COUNT]], CLN_COUNT, l, h, lp, hp, flora.data_found) : 0;
+									if (lp.r>0.00001) // don't add if radius tiny
+										copies = v ? (v<0 ? 0 : v) : 1;
 								}
 							}
-							preset_selected[n] = preset;
-							flower l = presets?presets[preset*2] : default_low;
-							flower h = presets?presets[preset*2+1] : default_high; // read out range for this index
+							row_copies[part_row[p]+r] = copies;
+						}
+					});
+					skip_rows = 0;
+
+					// place the rows in order and pick presets by name or in turn
+					int total = n;
+					for (int r=0; r<part_row[csv.num_parts]; r++)
+						total += row_copies[r];
+					if (total>capacity) {
+						int prev = capacity;
+						capacity = total>(capacity*2) ? total : capacity*2;
+						if (range)
+							ranges = memory.grow(ranges, prev*2, capacity*2);
+						else
+							flowers = memory.grow(flowers, prev, capacity);
+						flower_packs = memory.grow(flower_packs, prev * (range ? 2:1), capacity * (range ? 2:1));
+						preset_selected = memory.grow(preset_selected, prev, capacity);
+						if (aggregating) {
+							group_value = memory.grow(group_value, prev, capacity);
+							group_rows = memory.grow(group_rows, prev, capacity);
+						}
+					}
+					const char **currRow = part_rows;
+					for (int p=0; p<csv.num_parts; p++) {
+						for (int r=0; r<csv.parts[p].num_rows; r++) {
+							int copies = row_copies[part_row[p]+r];
+							row_slot[part_row[p]+r] = copies ? n : -1;
+							if (!copies)
+								continue;
+							if (range) { // ranges keep their own strings
+								n += copies;
+								continue;
+							}
+							u32 name = NO_STRING, value = NO_STRING;
+							if (name_col>=0) {
+								GetRow(csv.parts[p], r, currRow, columns);
+								name = strings.intern(currRow[name_col]);
+							}
+							if (aggregating) { // rows of a known group only add to its value
+								double v = row_value[part_row[p]+r];
+								int g = groups.find(strings.get(name));
+								aggregated_rows++;
+								if (g>=0) {
+									group_value[g] = flora.aggregate_op==AGG_MAX ? (v>group_value[g] ? v : group_value[g]) : group_value[g]+v;
+									group_rows[g]++;
+									row_slot[part_row[p]+r] = -1;
+									continue;
+								}
+								groups.insert(strings.get(name), n);
+								group_value[n] = v;
+								group_rows[n] = 1;
+							} else if (indices[CLN_VALUE]>=0)	// the value text is copied with the flower, with top only if it is kept
+								value = top ? (ROW_VALUE | u32(part_row[p]+r)) : strings.reserve(1);
+							if (num_presets) {
+								int preset = next_preset;
+								if (name!=NO_STRING && *strings.get(name)) {
+									u32 g = strings.group(name);
+									if (g>=u32(preset_of_size)) {
+										int size = preset_of_size;
+										preset_of_size = int(strings.capacity);
+										preset_of = memory.grow(preset_of, size, preset_of_size);
+										for (int i=size; i<preset_of_size; i++)
+											preset_of[i] = -1;
+									}
+									if (preset_of[g]<0)
+										preset_of[g] = preset;
+									preset = preset_of[g];
+								}
+								next_preset = (preset+1)%num_presets;
+								for (int cpy=0; cpy<copies; cpy++)
+									preset_selected[n+cpy] = preset;
+							}
+							for (int cpy=0; cpy<copies; cpy++) {
+								flowers[n+cpy].name = name;
+								flowers[n+cpy].value = value;
+							}
+							n += copies;
+						}
+					}
+
+					// create the flowers of each part
+					ParallelFor(csv.num_parts, [&](int p) {
+						const char **currRow = part_rows + p*columns;
+						for (int r=0; r<csv.parts[p].num_rows; r++) {
+							int slot = row_slot[part_row[p]+r];
+							if (slot<0)
+								continue;
+							GetRow(csv.parts[p], r, currRow, columns);
+							int preset = num_presets ? preset_selected[slot] : 0;
+							flower_spec l = presets?presets[preset*2] : default_low;
+							flower_spec h = presets?presets[preset*2+1] : default_high; // read out range for this index
 							flower_pack lp = preset_packs ? preset_packs[preset * 2] : default_low_pack;
 							flower_pack hp = preset_packs ? preset_packs[preset * 2 + 1] : default_high_pack; // read out range for this index
+							rng random(flora.seed, RNG_ROWS, u64(rows_read + part_row[p] + r));
 							int copies = 1;
 							for (int i=0; i<CLN_ENTRIES; i++) if (indices[i]>=0) {
-								int v = GetRange(currRow[indices[i]], (ColumnIndex)i, l, h, lp, hp);
-								if (v && i==CLN_COUNT) copies = v;
+								int v = GetRange(currRow[indices[i]], (ColumnIndex)i, l, h, lp, hp, flora.data_found);
+								if (v && i==CLN_COUNT && !aggregating) copies = v;
 							}
-							if (lp.r>0.00001) { // don't add if radius tiny
+
+							// names and values outlive the chunk
+							if (range) {
+								if (name_col>=0)
+									l.name = h.name = part_strings[p].add(l.name);
+								if (indices[CLN_VALUE]>=0) {
+									const char *value = part_strings[p].add(l.value);
+									h.value = value + (h.value - l.value);
+									l.value = value;
+								}
 								for (int cpy=0; cpy<copies; cpy++) {
-									if (range) { *f++ = l; *f++ = h; *fp++ = lp; *fp++ = hp; }
-									else { initflower(f, fp, l, h, lp, hp); f++; fp++;  }
-									n++; if (n==flowersToCreate) break;
+									ranges[(slot+cpy)*2] = l;
+									ranges[(slot+cpy)*2+1] = h;
+									flower_packs[(slot+cpy)*2] = lp;
+									flower_packs[(slot+cpy)*2+1] = hp;
 								}
+								continue;
+							}
+							u32 name = flowers[slot].name, value = flowers[slot].value;
+							if (value!=NO_STRING && !(value & ROW_VALUE))
+								strings.set(value, part_strings[p].add(l.value));
+							for (int cpy=0; cpy<copies; cpy++) {
+								flower *f = flowers + slot+cpy;
+								initflower(random, f, flower_packs + slot+cpy, l, h, lp, hp);
+								f->name = name;
+								f->value = value;
 							}
 						}
+					});
+					for (int p=0; p<csv.num_parts; p++)
+						strings.pool.take(part_strings[p]);
+					rows_read += part_row[csv.num_parts];
+					// only the largest flowers need to be kept while reading, the values of the
+					// flowers of this chunk that are kept are copied before the rows go away
+					if (top && !aggregating) {
+						KeepLargestFlowers(flowers, flower_packs, n, top, other, memory);
+						u32 row = NO_STRING, kept_value = NO_STRING;
+						for (int k=0; k<n; k++) {
+							u32 value = flowers[k].value;
+							if (value==NO_STRING || !(value & ROW_VALUE))
+								continue;
+							if (value!=row) {	// copies of a row are next to each other
+								int r = int(value & ~ROW_VALUE), p = 0;
+								while (r>=part_row[p+1]) p++;
+								GetRow(csv.parts[p], r-part_row[p], part_rows, columns);
+								const char *text = part_rows[indices[CLN_VALUE]];
+								while (*text==' ') text++;
+								kept_value = strings.add(text);
+								row = value;
+							}
+							flowers[k].value = kept_value;
+						}
 					}
-					count = n;
+					csv.progress(read_bytes, total_bytes);
+				} while (flora.progress.update(read_bytes, total_bytes) && csv.next());
+				if (aggregating) { // size each group by its combined value and drop the tiny ones
+					int kept = 0;
+					for (int g=0; g<n; g++) {
+						double v = group_value[g];
+						if (flora.aggregate_op==AGG_MEAN)
+							v /= double(group_rows[g]);
+						else if (flora.aggregate_op==AGG_COUNT)
+							v = double(group_rows[g]);
+						if (v<=0.0 || sqrt(v)<=0.00001)
+							continue;
+						char text[64];
+						sprintf(text, "%.15g", v);	// the whole total, not 6 digits
+						flowers[kept] = flowers[g];
+						flowers[kept].value = strings.add(text);
+						flower_packs[kept] = flower_packs[g];
+						flower_packs[kept].r = sqrt(v);	// area is value
+						kept++;
+					}
+					flora.Message("Aggregated %d rows into %d flowers by %s\n", aggregated_rows, kept, aggregate_name[flora.aggregate_op]);
+					n = kept;
 				}
+				if (top) {
+					KeepLargestFlowers(flowers, flower_packs, n, top, other, memory);
+					if (other.total) {
+						int bins = flora.top_bins;
+						if ((n+bins)>capacity) {
+							flowers = memory.grow(flowers, capacity, n+bins);
+							flower_packs = memory.grow(flower_packs, capacity, n+bins);
+							capacity = n+bins;
+						}
+						flora.Message("Kept the %d largest flowers, %d more are shown as other\n", n, other.total);
+						n = AddOtherFlowers(flowers, flower_packs, n, bins, other, strings, flora.seed);
+					}
+				}
+				if (n)
+					count = n;
+			}
+		}
+	}
+	if (ppF) *ppF = flowers;
+	if (ppR) *ppR = ranges;
+	*ppFP = flower_packs;
+}
+
+flower* readValuesFromCSV(Flora &flora, const char *filename, int &count, string_table &strings, arena &memory, flower_pack **ppFP,
+						  const flower_spec *presets=nullptr, const flower_pack *preset_packs=nullptr, int num_presets=0)
+{
+	flower *flowers = nullptr;
+	readFlowersFromCSV(flora, filename, count, strings, memory, &flowers, nullptr, ppFP, presets, preset_packs, num_presets);
+	return flowers;
+}
+
+// pairs of low and high flower properties for presets
+flower_spec* readRangesFromCSV(Flora &flora, const char *filename, int &count, string_table &strings, arena &memory, flower_pack **ppFP)
+{
+	flower_spec *ranges = nullptr;
+	readFlowersFromCSV(flora, filename, count, strings, memory, nullptr, &ranges, ppFP, nullptr, nullptr, 0);
+	return ranges;
+}
+
+// preset files read once and shared by runs on any thread, the ranges are read only
+#define MAX_CACHED_PRESETS 16
+
+struct preset_cache {
+	std::mutex lock;
+	arena memory;
+	string_table strings;
+	const char *names[MAX_CACHED_PRESETS];
+	flower_spec *ranges[MAX_CACHED_PRESETS];
+	flower_pack *packs[MAX_CACHED_PRESETS];
+	int counts[MAX_CACHED_PRESETS];
+	int count;
+
+	preset_cache() : count(0) {}
+	~preset_cache() { strings.clear(); }
+
+	const flower_spec *get(Flora &flora, const char *filename, int &num, const flower_pack *&preset_packs)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		int p = 0;
+		while (p<count && strcmp(names[p], filename)!=0)
+			p++;
+		if (p==MAX_CACHED_PRESETS)
+			return nullptr;
+		if (p==count) {
+			names[p] = strings.keep(filename);
+			counts[p] = 0;
+			packs[p] = nullptr;
+			ranges[p] = readRangesFromCSV(flora, filename, counts[p], strings, memory, &packs[p]);
+			count++;
+		}
+		num = counts[p];
+		preset_packs = packs[p];
+		return ranges[p];
+	}
+};
+
+
+//
+//
+// COMPILED DATA FILES
+//
+//
+
+
+// flowers, packs and the argument rows of a csv file saved in native binary form:
+//	header, argument string pairs, packs, flowers, string table
+// strings are referenced by their order in the table
+#define COMPILED_MAGIC "DAISYBIN"
+#define COMPILED_VERSION 2
+#define COMPILED_NO_STRING 0xffffffff
+#define COMPILED_EXT ".daisy"
+
+struct compiled_header {
+	char magic[8];
+	u32 version;
+	u32 count;				// flowers and packs
+	u32 num_args;			// argument rows as pairs of strings
+	u32 data_found;			// columns found in the csv file
+	u32 num_strings;		// strings in the string table
+	u32 reserved;
+	u64 strings_size;		// bytes in the string table
+};
+
+struct compiled_flower {
+	float c, a, k, f;
+	u32 name, value;		// order in string table
+	color col_pet, col_ctr;
+	u8 type;
+	u8 lin_pet, lin_ctr;
+};
+
+// table of unique strings for compiling
+struct compiled_strings {
+	name_map ordinals;
+	char *table;
+	size_t size, capacity;
+	u32 count;
+
+	compiled_strings() : ordinals(false), table(nullptr), size(0), capacity(0), count(0) {}
+	~compiled_strings() { if (table) free(table); }
+
+	u32 add(const char *str)
+	{
+		if (!str)
+			return COMPILED_NO_STRING;
+		int ord = ordinals.insert(str, (int)count);
+		if (u32(ord)==count) {
+			size_t len = strlen(str)+1;
+			if ((size+len)>capacity) {
+				capacity = (size+len)>(capacity*2) ? (size+len) : capacity*2;
+				table = (char*)realloc(table, capacity);
+			}
+			memcpy(table+size, str, len);
+			size += len;
+			count++;
+		}
+		return (u32)ord;
+	}
+};
+
+bool IsCompiledFile(const char *filename)
+{
+	char magic[sizeof(COMPILED_MAGIC)-1];
+	bool ret = false;
+	if (IsStdStream(filename))
+		return false;	// stdin can only be read once, as csv
+	if (FILE *f = fopen(filename, "rb")) {
+		ret = fread(magic, sizeof(magic), 1, f)==1 && memcmp(magic, COMPILED_MAGIC, sizeof(magic))==0;
+		fclose(f);
+	}
+	return ret;
+}
+
+bool writeCompiled(const char *filename, const flower *flowers, const flower_pack *packs, int count,
+				   const string_table &strings, const char **args, int num_args, int data_found, arena &memory)
+{
+	compiled_strings strs;
+	arena::mark temp = memory.get_mark();
+	u32 *arg_offs = memory.alloc<u32>(num_args*2+1);
+	for (int a=0; a<(num_args*2); a++)
+		arg_offs[a] = strs.add(args[a]);
+	u32 *ordinal = memory.alloc<u32>(strings.count);	// table order of each string index
+	for (u32 i=0; i<strings.count; i++)
+		ordinal[i] = COMPILED_NO_STRING;
+	auto str = [&](u32 index) -> u32 {
+		if (index==NO_STRING)
+			return COMPILED_NO_STRING;
+		if (ordinal[index]==COMPILED_NO_STRING)
+			ordinal[index] = strs.add(strings.get(index));
+		return ordinal[index];
+	};
+	compiled_flower *cf = memory.alloc_zero<compiled_flower>(count);
+	for (int n=0; n<count; n++) {
+		cf[n].c = flowers[n].c; cf[n].a = flowers[n].a; cf[n].k = flowers[n].k; cf[n].f = flowers[n].f;
+		cf[n].name = str(flowers[n].name);
+		cf[n].value = str(flowers[n].value);
+		cf[n].col_pet = flowers[n].col_pet; cf[n].col_ctr = flowers[n].col_ctr;
+		cf[n].type = flowers[n].type;
+		cf[n].lin_pet = flowers[n].lin_pet; cf[n].lin_ctr = flowers[n].lin_ctr;
+	}
+	compiled_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COMPILED_MAGIC, sizeof(hdr.magic));
+	hdr.version = COMPILED_VERSION;
+	hdr.count = (u32)count;
+	hdr.num_args = (u32)num_args;
+	hdr.data_found = (u32)data_found;
+	hdr.num_strings = strs.count;
+	hdr.strings_size = strs.size;
+	bool ok = false;
+	if (FILE *f = fopen(filename, "wb")) {
+		ok = fwrite(&hdr, sizeof(hdr), 1, f)==1 &&
+			fwrite(arg_offs, sizeof(u32), num_args*2, f)==size_t(num_args*2) &&
+			fwrite(packs, sizeof(flower_pack), count, f)==size_t(count) &&
+			fwrite(cf, sizeof(compiled_flower), count, f)==size_t(count) &&
+			fwrite(strs.table, 1, strs.size, f)==strs.size;
+		if (fclose(f)!=0)
+			ok = false;
+	}
+	memory.release(temp);
+	return ok;
+}
+
+// load flowers saved by writeCompiled and apply its argument rows, no parsing required
+flower* readCompiled(Flora &flora, const char *filename, int &count, string_table &strings, arena &memory, flower_pack **ppFP)
+{
+	flower *flowers = nullptr;
+	flower_pack *flower_packs = nullptr;
+	size_t size = 0;
+	char *data = nullptr;
+	mapped_file *map = MapFile(filename);
+	if (map) {
+		data = map->data;
+		size = map->size;
+	} else
+		data = ReadFile(filename, size, memory);
+	const compiled_header *hdr = (const compiled_header*)data;
+	if (data && size>=sizeof(compiled_header) && memcmp(hdr->magic, COMPILED_MAGIC, sizeof(hdr->magic))==0 &&
+		hdr->version==COMPILED_VERSION && hdr->strings_size<=size &&
+		(sizeof(compiled_header) + u64(hdr->num_args) * 2 * sizeof(u32) +
+		 u64(hdr->count) * (sizeof(flower_pack) + sizeof(compiled_flower)) + hdr->strings_size)==size &&
+		(!hdr->strings_size || data[size-1]==0)) {
+		const u32 *arg_offs = (const u32*)(hdr+1);
+		const flower_pack *packs = (const flower_pack*)(arg_offs + hdr->num_args*2);
+		const compiled_flower *cf = (const compiled_flower*)(packs + hdr->count);
+		u64 strings_size = hdr->strings_size;
+		char *table = strings.pool.alloc(strings_size ? size_t(strings_size) : 1);
+		memcpy(table, (const char*)(cf + hdr->count), size_t(strings_size));
+		// one walk over the table indexes every string
+		u32 num_strings = 0;
+		u32 *index = memory.alloc<u32>(hdr->num_strings);
+		for (u64 offs=0; offs<strings_size && num_strings<hdr->num_strings; num_strings++) {
+			index[num_strings] = strings.insert(table+offs);
+			offs += strlen(table+offs)+1;
+		}
+		auto id = [&](u32 ord) -> u32 { return ord<num_strings ? index[ord] : NO_STRING; };
+		auto str = [&](u32 ord) -> const char* { return strings.get(id(ord)); };
+		const char *keep_data_file = flora.data_file;	// the data already came from it
+		for (u32 a=0; a<hdr->num_args; a++) {
+			const char *command = str(arg_offs[a*2]), *arg = str(arg_offs[a*2+1]);
+			if (command && arg && !RunArgument(ArgumentIndex(command)))	// compile never writes these, a hand edited file could name data= or compile=
+				flora.Argument(command, arg, true);
+		}
+		flora.data_file = keep_data_file;
+		flora.data_found |= hdr->data_found;
+		if (hdr->count) {
+			count = (int)hdr->count;
+			flowers = memory.alloc<flower>(count);
+			flower_packs = memory.alloc<flower_pack>(count);
+			memcpy(flower_packs, packs, sizeof(flower_pack) * count);
+			for (int n=0; n<count; n++) {
+				flower &f = flowers[n];
+				f.c = cf[n].c; f.a = cf[n].a; f.k = cf[n].k; f.f = cf[n].f;
+				f.name = id(cf[n].name);
+				f.value = id(cf[n].value);
+				f.col_pet = cf[n].col_pet; f.col_ctr = cf[n].col_ctr;
+				f.type = cf[n].type;
+				f.lin_pet = cf[n].lin_pet; f.lin_ctr = cf[n].lin_ctr;
 			}
 		}
-		free((void*)pCells);
-	}
-	*mem = CSV;
+	} else if (data)
+		flora.Message("\"%s\" is not a compiled flower file for this version\n", filename);
+	if (map)
+		UnmapFile(map);
 	*ppFP = flower_packs;
 	return flowers;
 }
 
+
 color mixColor(color a, color b, u8 m)
 {
 	int im = (int)m;
@@ -1482,23 +3960,32 @@ color mixColor(color a, color b, u8 m)
 	return ret;
 }
 
-// If flowers have the same name they are duplictes so make them look similar
-bool CombineSharedNames(flower *flowers, int count)
+// If flowers have the same name they are duplictes so make them look similar to the first one
+bool CombineSharedNames(flower *flowers, int count, const string_table &strings, arena &memory)
 {
 	bool sets = false;
-	for (int n=1; n<count; n++) {
-		for (int c=0; c<n; c++) {
-			if (flowers[n].name && flowers[c].name && strcasecmp(flowers[n].name, flowers[c].name)==0) {
-				sets = true;
-				flowers[n].col_ctr = mixColor(flowers[n].col_ctr, flowers[c].col_ctr, 16);
-				flowers[n].col_pet = mixColor(flowers[n].col_pet, flowers[c].col_pet, 16);
-				flowers[n].c = (flowers[n].c-flowers[c].c)*0.2 + flowers[c].c;
-				flowers[n].k = (flowers[n].k-flowers[c].k)*0.2 + flowers[c].k;
-				flowers[n].f = (flowers[n].f-flowers[c].f)*0.2 + flowers[c].f;
-				flowers[n].type = flowers[c].type;
-			}
+	arena::mark temp = memory.get_mark();
+	int *first = memory.alloc<int>(strings.count);	// first flower of each group of names
+	for (u32 i=0; i<strings.count; i++)
+		first[i] = -1;
+	for (int n=0; n<count; n++) {
+		u32 g = strings.group(flowers[n].name);
+		if (g==NO_STRING)
+			continue;
+		if (first[g]<0)
+			first[g] = n;
+		int c = first[g];
+		if (c!=n) {
+			sets = true;
+			flowers[n].col_ctr = mixColor(flowers[n].col_ctr, flowers[c].col_ctr, 16);
+			flowers[n].col_pet = mixColor(flowers[n].col_pet, flowers[c].col_pet, 16);
+			flowers[n].c = (flowers[n].c-flowers[c].c)*0.2 + flowers[c].c;
+			flowers[n].k = (flowers[n].k-flowers[c].k)*0.2 + flowers[c].k;
+			flowers[n].f = (flowers[n].f-flowers[c].f)*0.2 + flowers[c].f;
+			flowers[n].type = flowers[c].type;
 		}
 	}
+	memory.release(temp);
 	return sets;
 }
 
@@ -1514,21 +4001,15 @@ int byIndex(const char *value, const char **aList, int nList, int default_value)
 
 bool Flora::Argument(const char *command, const char *arg, bool full)
 {
-	// find the argument with the longest matching prefix
-	arguments best = A_COUNT;
-	int mostSame = 0;
-	for (int a=A_ASPECT; a<A_COUNT; a++) {
-		int same = 0; const char *f=command; const char *s=cmd_args[a];
-		while (*f!='=' && tolower(*f++)==tolower(*s++)) same++;
-		if (same>mostSame) {
-			best = (arguments)a;
-			mostSame = same;
-		}
-	}
+	arguments best = ArgumentIndex(command);
 	
 	// double check full name if required (arguments read from csv file)
 	if (full && best<A_COUNT && strncasecmp(command, cmd_args[best], strlen(cmd_args[best]))!=0)
 		return false;
+	if (no_files && FileArgument(best)) {
+		Message("%s can't name a file here\n", cmd_args[best]);
+		return false;
+	}
 	
 	if (!arg) {
 		while (*command && *command++!='=');
@@ -1538,23 +4019,44 @@ bool Flora::Argument(const char *command, const char *arg, bool full)
 	switch (best) {
 		case A_ASPECT:
 			aspect = strtod(arg, nullptr);
-			printf("Aspect=%f\n", aspect);
+			Message("Aspect=%f\n", aspect);
+			break;
+		case A_AGGREGATE:
+			aggregate_op = (aggregate)byIndex(arg, aggregate_name, AGG_COUNT_OPS, AGG_SUM);
+			aggregate_column = nullptr;
+			if (const char *col=strchr(arg, ':'))
+				aggregate_column = col+1;
+			Message("Aggregate=%s%s%s\n", aggregate_name[aggregate_op], aggregate_column ? " by " : "", aggregate_column ? aggregate_column : "");
 			break;
 		case A_BACKGROUND: {
 			background = read_col(arg);
-			background_file = arg;
+			background_file = no_files ? nullptr : arg;
 			u8 r = (background.r+background.g+background.b)<(128*3) ? 255 : 0;
 			color l = { r, r, r, 255 };
 			if (!(user_args & (1U<<A_COLOR)))
 				text_color = l;
 			if (!(user_args & (1U<<A_NAME_COLOR)))
 				name_color = l;
-			printf("Background=%s\n", arg);
+			Message("Background=%s\n", arg);
 			break;
 		}
+		case A_BATCH:
+			batch_file = arg;
+			Message("Batch=%s\n", arg);
+			break;
+		case A_SERVE:
+			serve_addr = arg;
+			Message("Serve=%s\n", arg);
+			break;
+		case A_STATS:
+			stats_file = arg;
+			break;
+		case A_COMPILE:
+			compile_file = arg;
+			break;
 		case A_DATA:
 			data_file = arg;
-			printf("Data=%s\n", arg);
+			Message("Data=%s\n", arg);
 			break;
 		case A_COLOR:
 			text_color = read_col(arg);
@@ -1563,7 +4065,7 @@ bool Flora::Argument(const char *command, const char *arg, bool full)
 			break;
 		case A_FONT:
 			font_name = arg;
-			printf("Font=%s\n", font_name);
+			Message("Font=%s\n", font_name);
 			break;
 		case A_LEGEND:
 			if (tolower(arg[0])=='i')
@@ -1572,19 +4074,19 @@ bool Flora::Argument(const char *command, const char *arg, bool full)
 				legend_height = atoi(arg);
 				if (const char *fs=strchr(arg,':'))
 					font_name=fs+1;
-				printf("Legend=%d\n", legend_height);
+				Message("Legend=%d\n", legend_height);
 			}
 			break;
 		case A_MAKE:
 			shape = (fit)byIndex(arg, fit_name, FIT_COUNT, shape);
-			printf("Make=%s\n", fit_name[shape]);
+			Message("Make=%s\n", fit_name[shape]);
 			break;
 		case A_NAME_COLOR:
 			name_color = read_col(arg);
 			break;
 		case A_ORDER:
 			order = (sort)byIndex(arg, sort_name, SORT_COUNT, order);
-			printf("Order=%s\n", sort_name[order]);
+			Message("Order=%s\n", sort_name[order]);
 			break;
 		case A_PRESET:
 			if (!presets) {
@@ -1597,17 +4099,24 @@ bool Flora::Argument(const char *command, const char *arg, bool full)
 						pset = pbuf;
 					}
 				}
-				if ((presets = readValuesFromCSV(pset, true, num_presets, &preset_str, &preset_packs)))
-					printf("Preset=%s\n", arg);
+				if (preset_files)
+					presets = preset_files->get(*this, pset, num_presets, preset_packs);
+				else {
+					flower_pack *packs = nullptr;
+					presets = readRangesFromCSV(*this, pset, num_presets, strings, memory, &packs);
+					preset_packs = packs;
+				}
+				if (presets)
+					Message("Preset=%s\n", arg);
 			}
 			break;
 		case A_RANDOM:
 			random_flowers = atoi(arg);
-			printf("Random=%d\n", random_flowers);
+			Message("Random=%d\n", random_flowers);
 			break;
 		case A_SIZE:
 			img_widhgt = atoi(arg);
-			printf("Size=%d\n", img_widhgt);
+			Message("Size=%d\n", img_widhgt);
 			break;
 		case A_TITLE:
 			title_height = img_widhgt / 16;
@@ -1617,71 +4126,143 @@ bool Flora::Argument(const char *command, const char *arg, bool full)
 				title_str = c+1;
 			}
 			break;
+		case A_SEED:
+			seed = strtoull(arg, nullptr, 10);
+			Message("Seed=%llu\n", (unsigned long long)seed);
+			break;
+		case A_TOP:
+			top_count = atoi(arg);
+			if (top_count<=0) {
+				Message("Top=%s is not a count above 0, all flowers are kept\n", arg);
+				top_count = 0;
+				break;
+			}
+			if (top_count>TOP_MAX)
+				top_count = TOP_MAX;
+			top_bins = 1;
+			if (const char *b=strchr(arg, ':'))
+				top_bins = atoi(b+1);
+			top_bins = top_bins<1 ? 1 : (top_bins>OTHER_MAX_BINS ? OTHER_MAX_BINS : top_bins);
+			Message("Top=%d\n", top_count);
+			break;
 		default:
 			if (!full)
-				printf("Unknown parameter \"%s\"\n", command);
+				Message("Unknown parameter \"%s\"\n", command);
 			return false;
 	}
 	user_args |= 1U<<(unsigned int)best;
 	return true;
 }
 
+// everything a run allocated is released at once
+void Flora::EndRun()
+{
+	ShutdownFont(font);
+	rendered = false;
+	bitmap = nullptr;
+	img_wid = img_hgt = 0;
+	data_text = nullptr;
+	data_text_size = 0;
+	data_cells = nullptr;
+	data_columns = data_rows = 0;
+	presets = nullptr;
+	preset_packs = nullptr;
+	num_presets = 0;
+	strings.clear();
+	memory.reset();
+}
+
 #define EDGE_MARGIN 8
-int Flora::Do()
+#define RANDOM_CHUNK 16384
+// read or randomize the flowers and paint them into bitmap, compiling stops after reading
+int Flora::Render()
 {
-	// INSTRUCTIONS CHECK
-	if (out_file && (*out_file=='?' || strcasecmp(out_file, "help")==0 || strcasecmp(out_file, "-h")==0 || strcasecmp(out_file, "h")==0)) {
-		fputs(Instructions, stdout);
-		return 0;
-	}
+	rendered = true;
+	stats.clear();
+	progress.messages = messages;
 	
-	// MAKE SURE RANDOM IS UNIQUE
-	srand ((unsigned int)time(NULL));
+	// MAKE SURE RANDOM IS UNIQUE UNLESS A SEED IS GIVEN
+	if (!(user_args & (1U<<A_SEED))) {
+		seed = (u64)time(NULL);
+		Message("Seed=%llu\n", (unsigned long long)seed);
+	}
 	
 	// LOAD OR RANDOMIZE SET OF FLOWERS
 	int num_flowers = 0;
 	flower* flowers = nullptr;
 	flower_pack* flower_packs = nullptr;
-	if (data_file)
-		flowers = readValuesFromCSV(data_file, false, num_flowers, &data_str, &flower_packs, presets, preset_packs, num_presets);
+	stats.begin(PHASE_PARSE);
+	progress.begin(PHASE_PARSE);
+	if (data_text || data_cells)
+		flowers = readValuesFromCSV(*this, nullptr, num_flowers, strings, memory, &flower_packs, presets, preset_packs, num_presets);
+	else if (data_file && IsCompiledFile(data_file))
+		flowers = readCompiled(*this, data_file, num_flowers, strings, memory, &flower_packs);
+	else if (data_file)
+		flowers = readValuesFromCSV(*this, data_file, num_flowers, strings, memory, &flower_packs, presets, preset_packs, num_presets);
+	if (progress.cancelled()) {
+		stats.end(PHASE_PARSE);
+		Message("Cancelled\n");
+		return 1;
+	}
 	
-	if (random_flowers) {
-		flower *flowers_rand = (flower*)malloc(sizeof(flower) * (random_flowers+num_flowers));
-		flower_pack *flowers_pack_rand = (flower_pack*)malloc(sizeof(flower_pack) * (random_flowers + num_flowers));
-		if (flowers) {
-			memcpy(flowers_rand, flowers, sizeof(flower) * num_flowers); free(flowers); flowers = nullptr;
-			memcpy(flowers_pack_rand, flower_packs, sizeof(flower_pack) * num_flowers); free(flower_packs); flower_packs = nullptr;
+	// SAVE FLOWERS AS BINARY
+	if (compile_file) {
+		char compile_buf[512];
+		if (!*compile_file && data_file) { // replace the extension of the data file
+			int last_dot=(int)strlen(data_file)-1;
+			while (last_dot>=0 && data_file[last_dot]!='.') last_dot--;
+			if (last_dot>=0 && last_dot<int(sizeof(compile_buf)-sizeof(COMPILED_EXT))) {
+				memcpy(compile_buf, data_file, last_dot);
+				memcpy(compile_buf+last_dot, COMPILED_EXT, sizeof(COMPILED_EXT));
+				compile_file = strings.keep(compile_buf);
+			}
 		}
+		bool ok = flowers && *compile_file && writeCompiled(compile_file, flowers, flower_packs, num_flowers,
+															strings, data_args, num_data_args, data_found, memory);
+		if (ok)
+			Message("Compiled %d flowers to \"%s\"\n", num_flowers, compile_file);
+		else
+			Message("Could not compile \"%s\"\n", data_file ? data_file : "");
+		stats.end(PHASE_PARSE);
+		return ok ? 0 : 1;
+	}
+
+	if (random_flowers) {
+		// grow the arrays once and fill in chunks on all threads, each chunk has its own random stream
 		int first_rand = num_flowers;
 		num_flowers += random_flowers;
-		flowers = flowers_rand;
-		flower_packs = flowers_pack_rand;
-		for (int n=first_rand; n<num_flowers; n++) {
-			if (num_presets)
-				initflower(flowers_rand+n, flowers_pack_rand+n, presets[(n%num_presets)*2], presets[(n%num_presets)*2+1], preset_packs[(n%num_presets)*2], preset_packs[(n%num_presets)*2+1]);
-			else
-				initflower(flowers_rand+n, flowers_pack_rand+n, default_low, default_high, default_low_pack, default_high_pack);
+		flowers = memory.grow(flowers, first_rand, num_flowers);
+		flower_packs = memory.grow(flower_packs, first_rand, num_flowers);
+		u32 *preset_strings = memory.alloc<u32>(num_presets*2+1);	// name and value of each preset
+		for (int p=0; p<num_presets; p++) {
+			preset_strings[p*2] = presets[p*2].name ? strings.intern(presets[p*2].name) : NO_STRING;
+			preset_strings[p*2+1] = presets[p*2].value ? strings.add(presets[p*2].value) : NO_STRING;
 		}
+		ParallelFor((random_flowers + RANDOM_CHUNK-1) / RANDOM_CHUNK, [&](int chunk) {
+			rng random(seed, RNG_RANDOM, u64(chunk));
+			int end = first_rand + (chunk+1)*RANDOM_CHUNK;
+			for (int n=first_rand + chunk*RANDOM_CHUNK; n<end && n<num_flowers; n++) {
+				if (num_presets) {
+					int p = n%num_presets;
+					initflower(random, flowers+n, flower_packs+n, presets[p*2], presets[p*2+1], preset_packs[p*2], preset_packs[p*2+1]);
+					flowers[n].name = preset_strings[p*2];
+					flowers[n].value = preset_strings[p*2+1];
+				} else
+					initflower(random, flowers+n, flower_packs+n, default_low, default_high, default_low_pack, default_high_pack);
+			}
+		});
 	}
-	bool sets = CombineSharedNames(flowers, num_flowers);
-	
-	// RELEASE PRESETS
-	if (presets) {
-		free(presets);
-		presets = nullptr;
-	}
+	bool sets = CombineSharedNames(flowers, num_flowers, strings, memory);
+	stats.end(PHASE_PARSE);
+	stats.flowers = num_flowers;
 	
 	// CHECK IF THERE IS ANY WORK
 	if (!flowers) {
-		fputs("Nothing to do\n", stdout);
-		fputs(Instructions, stdout);
-		if (data_str) free((void*)data_str);
-		if (preset_str) free((void*)preset_str);
+		Message("Nothing to do\n%s", Instructions);
 		return 0;
 	}
 	
 	// CHECK IMPLIED ARGUMENTS
-	char out_file_buf[512], title_buf[128];
 	if (!out_file) {//"flowers.png"
 		if (data_file) {
 			int last_dot=(int)strlen(data_file)-1;
@@ -1692,12 +4273,12 @@ int Flora::Do()
 				memcpy(out_file_buf+last_dot, ".png", 5);
 			}
 		}
-		if (!data_file)
+		if (!data_file && !data_text && !data_cells)
 			data_file = "flowers.png";
 	}
 	if (!legend_height && (data_found&((1U<<CLN_NAME)|(1U<<CLN_VALUE))) == ((1U<<CLN_NAME)|(1U<<CLN_VALUE))) {
 		legend_height = legend_inside ? 0 : (img_widhgt>>6);
-		if (!title_height && data_file) {
+		if (!title_height && data_file && !IsStdStream(data_file)) {
 			int last_sls=(int)strlen(data_file), max_dot=last_sls;
 			while (last_sls>=0 && data_file[last_sls]!='\\' && data_file[last_sls]!='/') last_sls--;
 			int first_dot = last_sls+1;
@@ -1715,9 +4296,9 @@ int Flora::Do()
 	
 	// IMAGE SETUP
 	unsigned int bc = *(unsigned int*)&background;
-	unsigned int *bitmap = nullptr;
-	int img_wid = -1;
-	int img_hgt = -1;
+	bitmap = nullptr;
+	img_wid = -1;
+	img_hgt = -1;
 	
 	// LOAD BACKGROUND IMAGE
 	if (background_file) {
@@ -1732,29 +4313,39 @@ int Flora::Do()
 				background = b;
 				img_wid = width; img_hgt = height;
 				aspect = (double)width / (double)height;
+				bitmap = memory.alloc<unsigned int>(size_t(width) * size_t(height));
 				if (channels==4)
-					bitmap = (unsigned int*)data;
+					memcpy(bitmap, data, size_t(width) * size_t(height) * sizeof(unsigned int));
 				else {
-					bitmap = (unsigned int*)malloc(width * height * sizeof(unsigned int));
 					for (int i=0; i<(width*height); i++) {
 						bitmap[i] = bc;
 						for (int c=0; c<channels; c++)
 							((unsigned char*)(bitmap+i))[c] = data[i*channels+c];
 					}
-					free(data);
 				}
+				stbi_image_free(data);
 			}
 		}
 	}
 	
 	// SORT
-	reorder(flowers, flower_packs, num_flowers, order);
+	stats.begin(PHASE_REORDER);
+	reorder(flowers, flower_packs, num_flowers, order, seed, strings, memory);
+	stats.end(PHASE_REORDER);
 	
 	// PACK
-	printf("Arranging %d flowers\n", num_flowers);
-	pack_flowers(flower_packs, num_flowers, shape, aspect);
+	Message("Arranging %d flowers\n", num_flowers);
+	stats.begin(PHASE_PACK);
+	progress.begin(PHASE_PACK);
+	pack_flowers(flower_packs, num_flowers, shape, aspect, seed, memory, progress, stats);
+	stats.end(PHASE_PACK);
+	if (progress.cancelled()) {
+		Message("Cancelled\n");
+		return 1;
+	}
 	
 	// FIT TO BITMAP
+	stats.begin(PHASE_FIT);
 	double minx=0.0, maxx=0.0, miny=0.0, maxy=0.0;
 	int scale_op = 0;
 	while (scale_op<2) {
@@ -1790,8 +4381,13 @@ int Flora::Do()
 	
 	double cx = 0.5*((double)img_wid-(maxx-minx));
 	double cy = 0.5*((double)img_hgt-(maxy-miny));
+	stats.end(PHASE_FIT);
 	
-	bool hasFont = (legend_height || legend_inside || (title_height&&title_str)) && InitFont(font_name);
+	stats.begin(PHASE_TEXT);
+	bool hasFont = (legend_height || legend_inside || (title_height&&title_str)) &&
+		(fonts ? fonts->get(font, font_name, memory) : InitFont(font, font_name, memory));
+	if (hasFont)
+		Message("Loaded Font \"%s\"\n", font_name);
 	int legend_columns = 0;
 	int legend_lines = 0;
 	int legend_count = 0;
@@ -1803,23 +4399,22 @@ int Flora::Do()
 	}
 	double legend_center = 0.0;
 	if (legend_height && hasFont && !legend_inside) {
-		double scale = FontSizeScale((float)legend_height);
+		double scale = FontSizeScale(font, (float)legend_height);
 		double lg_minx=0, lg_maxx=0, lg_miny=0, lg_maxy=0;
+		arena::mark temp = memory.get_mark();
+		u8 *listed = memory.alloc_zero<u8>(strings.count);	// names already in the legend
 		for (flower* f=flowers; f<(flowers+num_flowers); f++) {
-			if (f->name) {
-				// determine if unique
-				bool dupe = false;
-				for (flower* g=flowers; g<f && !dupe; g++) {
-					if (g->name && strcasecmp(g->name, f->name)==0)
-						dupe = true;
-				}
-				if (!dupe) {
+			u32 g = strings.group(f->name);
+			if (g!=NO_STRING) {
+				// only the first of each name
+				if (!listed[g]) {
+					listed[g] = 1;
 					char text[512];
-					if (f->value && !sets)
-						sprintf(text, "%s: %s", f->name, f->value);
+					if (f->value!=NO_STRING && !sets)
+						sprintf(text, "%s: %s", strings.get(f->name), strings.get(f->value));
 					else
-						sprintf(text, "%s", f->name);
-					textspace space = GetTextSpace((const unsigned char*)text);
+						sprintf(text, "%s", strings.get(f->name));
+					textspace space = GetTextSpace(font, (const unsigned char*)text);
 					if (lg_minx>(scale*space.minx)) lg_minx = scale*space.minx;
 					if (lg_maxx<(scale*space.maxx)) lg_maxx = scale*space.maxx;
 					if (lg_miny>(scale*space.miny)) lg_miny = scale*space.miny;
@@ -1828,6 +4423,7 @@ int Flora::Do()
 				}
 			}
 		}
+		memory.release(temp);
 		lg_maxx += legend_height; // room for flower :)
 		
 		if (legend_count) {
@@ -1846,135 +4442,823 @@ int Flora::Do()
 				img_hgt += legend_height * legend_lines;
 		}
 	}
+	stats.end(PHASE_TEXT);
 	
+	stats.begin(PHASE_FIT);
 	size_t img_size = size_t(img_wid) * size_t(img_hgt) * sizeof(unsigned int);
 	
 	if (!bitmap) {
-		bitmap = (unsigned int*)malloc(img_size);
+		bitmap = (unsigned int*)memory.alloc(img_size);
 		if (bitmap) for (int i=0; i<(img_wid * img_hgt); i++)
 			bitmap[i] = bc;
 	}
+	stats.end(PHASE_FIT);
 	
 	if (!bitmap) {
-		printf("Could not allocate memory for %d x %d pixels (%d MB)\n",
+		Message("Could not allocate memory for %d x %d pixels (%d MB)\n",
 			   img_wid, img_hgt, img_size*4/(1024*1024));
-		if (data_str) free((void*)data_str);
-		if (preset_str) free((void*)preset_str);
-		if (extra_str) free((void*)extra_str);
-		if (flowers) free((void*)flowers);
 		return 1;
 	}
 	
-	printf("Image size: %.d, %d\nPainting %d flowers..\n", img_wid, img_hgt, num_flowers);
+	Message("Image size: %.d, %d\nPainting %d flowers..\n", img_wid, img_hgt, num_flowers);
+	stats.begin(PHASE_PAINT);
+	progress.begin(PHASE_PAINT);
 	flower_pack *fp = flower_packs;
 	for (flower* f=flowers; f<(flowers+num_flowers); f++, fp++) {
-		drawnpetal(bitmap, img_wid, fp->x + cx, fp->y + cy, fp->r, f->c * fp->r, f->a, 0.05 / (f->k), f->f,
-				   *(unsigned int*)&f->col_pet, *(unsigned int*)&f->col_ctr, f->type);
+		stats.pixels += drawnpetal(bitmap, img_wid, fp->x + cx, fp->y + cy, fp->r, f->c * fp->r, f->a, 0.05 / (f->k), f->f,
+								   *(unsigned int*)&f->col_pet, *(unsigned int*)&f->col_ctr, f->type);
+		if (!progress.update(u64(f-flowers+1), u64(num_flowers)))
+			break;
+	}
+	stats.end(PHASE_PAINT);
+	if (progress.cancelled()) {
+		bitmap = nullptr;	// half painted
+		Message("Cancelled\n");
+		return 1;
 	}
 	
+	stats.begin(PHASE_TEXT);
 	if (title_height && title_str && hasFont) {
-		printf("Adding title \"%s\"\n", title_str);
-		double scale = FontSizeScale((float)title_height);
-		int baseline = FontBaseline();
-		textspace box = GetTextSpace((unsigned const char*)title_str);
+		Message("Adding title \"%s\"\n", title_str);
+		double scale = FontSizeScale(font, (float)title_height);
+		int baseline = FontBaseline(font);
+		textspace box = GetTextSpace(font, (unsigned const char*)title_str);
 		if (scale*(box.maxx - box.minx) > (img_wid + 2 * EDGE_MARGIN)) scale = double(img_wid + 2 * EDGE_MARGIN) / double(box.maxx - box.minx);
-		DrawTextAt((const unsigned char*)title_str, (float)scale, 0.5*(img_wid-scale*(box.maxx-box.minx)),
+		DrawTextAt(font, (const unsigned char*)title_str, (float)scale, 0.5*(img_wid-scale*(box.maxx-box.minx)),
 				   scale*baseline, text_color, bitmap, img_wid, img_hgt);
 	}
 	if (legend_inside && hasFont) {
-		printf("Adding legend inside..\n");
+		Message("Adding legend inside..\n");
+		label_cache labels(strings.count, memory);
+		int culled = 0;
 		fp = flower_packs;
 		for (flower* f=flowers; f<(flowers+num_flowers); f++, fp++) {
-			if (f->name) {
-				textspace box = GetTextSpace((unsigned const char*)f->name);
+			// text is never taller than the flower so tiny flowers can be skipped unmeasured
+			if (f->name!=NO_STRING && (2.0*fp->r)<MIN_LABEL_PIXELS)
+				culled++;
+			else if (f->name!=NO_STRING) {
+				const textspace &box = labels.get(font, strings, f->name);
 				color c = name_color;
 				double w = box.maxx-box.maxy, h = box.maxy-box.miny;
 				double mh = 0.5*(box.minx+box.maxx), mv = 0.5*(box.miny+box.maxy);
 				double scale = 2.0*fp->r/sqrt(w*w+h*h);
-				DrawTextAt((const unsigned char*)f->name, (float)scale, fp->x+cx-scale*mh, fp->y+cy-scale*mv, c, bitmap, img_wid, img_hgt);
+				if ((scale*h)<MIN_LABEL_PIXELS) {
+					culled++;
+					continue;
+				}
+				DrawTextAt(font, (const unsigned char*)strings.get(f->name), (float)scale, fp->x+cx-scale*mh, fp->y+cy-scale*mv, c, bitmap, img_wid, img_hgt);
 			}
 		}
+		if (culled)
+			Message("Skipped %d names too small to read\n", culled);
 	} else if (legend_height && hasFont) {
-		printf("Adding legend..\n");
-		double scale = FontSizeScale((float)legend_height);
-		int centerHgt = FontCenterHgt();
+		Message("Adding legend..\n");
+		double scale = FontSizeScale(font, (float)legend_height);
+		int centerHgt = FontCenterHgt(font);
 		int n = 0;
+		u8 *listed = memory.alloc_zero<u8>(strings.count);
 		for (flower* f=flowers; f<(flowers+num_flowers); f++) {
-			if (f->name) {
-				bool dupe = false;
-				for (flower* g=flowers; g<f && !dupe; g++) {
-					if (g->name && strcasecmp(g->name, f->name)==0)
-						dupe = true;
-				}
-				if (!dupe) {
+			u32 g = strings.group(f->name);
+			if (g!=NO_STRING) {
+				if (!listed[g]) {
+					listed[g] = 1;
 					char text[512];
-					if (f->value && !sets)
-						sprintf(text, "%s: %s", f->name, f->value);
+					if (f->value!=NO_STRING && !sets)
+						sprintf(text, "%s: %s", strings.get(f->name), strings.get(f->value));
 					else
-						sprintf(text, "%s", f->name);
+						sprintf(text, "%s", strings.get(f->name));
 					color c = name_color;
 					double y = img_hgt-(legend_lines-n/legend_columns) * legend_height - EDGE_MARGIN+scale*centerHgt;
 					double x = (img_wid/legend_columns) * (n%legend_columns) + legend_height + legend_center;
-					drawnpetal(bitmap, img_wid, x, y, 0.5*legend_height, f->c * 0.5 * legend_height, 0.0, 0.25/(f->k*f->k), f->f,
-							   *(unsigned int*)&f->col_pet, *(unsigned int*)&f->col_ctr, f->type);
-					DrawTextAt((const unsigned char*)text, (float)scale, x+legend_height,
+					stats.pixels += drawnpetal(bitmap, img_wid, x, y, 0.5*legend_height, f->c * 0.5 * legend_height, 0.0, 0.25/(f->k*f->k), f->f,
+											   *(unsigned int*)&f->col_pet, *(unsigned int*)&f->col_ctr, f->type);
+					DrawTextAt(font, (const unsigned char*)text, (float)scale, x+legend_height,
 							   y+scale*centerHgt, c, bitmap, img_wid, img_hgt);
 					n++;
 				}
 			}
 		}
 	}
+	stats.end(PHASE_TEXT);
+
+	return 0;
+}
+
+// encode the rendered bitmap as png, tga or bmp, false for other formats or if cancelled
+bool Flora::Encode(const char *format, stbi_write_func *func, void *context)
+{
+	progress.begin(PHASE_ENCODE);
+	if (!bitmap || !progress.update(0, 1))
+		return false;
+	stats.begin(PHASE_ENCODE);
+	bool ok = WriteImage(format, func, context, img_wid, img_hgt, bitmap);
+	stats.end(PHASE_ENCODE);
+	progress.update(1, 1);
+	return ok;
+}
 
-	free(flowers);
-	ShutdownFont();
-	if (data_str) free((void*)data_str);
-	if (preset_str) free((void*)preset_str);
-	if (extra_str) free((void*)extra_str);
+// write the rendered bitmap to out_file, "-" is png to stdout
+bool Flora::Save()
+{
+	Message("Saving result as \"%s\"...\n", out_file);
+	if (IsStdStream(out_file)) {
+		SetBinaryStream(stdout);
+		bool ok = Encode("png", WriteToFile, stdout);
+		fflush(stdout);
+		return ok;
+	}
+	size_t out_file_len = strlen(out_file);
+	const char *ext = out_file_len>=4 && out_file[out_file_len-4]=='.' ? out_file+out_file_len-3 : "";
+	if (strcasecmp(ext, "png")!=0 && strcasecmp(ext, "tga")!=0 && strcasecmp(ext, "bmp")!=0)
+		return false;
+	FILE *f = fopen(out_file, "wb");
+	if (!f)
+		return false;
+	bool ok = Encode(ext, WriteToFile, f);
+	return fclose(f)==0 && ok;
+}
 
-	if (out_file) {
-		printf("Saving result as \"%s\"...\n", out_file);
-		size_t out_file_len = strlen(out_file);
-		if (out_file_len>=4 && strcasecmp(out_file+out_file_len-4, ".png")==0)
-			stbi_write_png(out_file, img_wid, img_hgt, 4, bitmap, 0);
-		if (out_file_len>=4 && strcasecmp(out_file+out_file_len-4, ".tga")==0)
-			SaveTGA(out_file, img_wid, img_hgt, (u8*)bitmap);
-		if (out_file_len>=4 && strcasecmp(out_file+out_file_len-4, ".bmp")==0)
-			stbi_write_bmp(out_file, img_wid, img_hgt, 4, bitmap);
+// write the times and counts of the last render as json to stats_file, "-" is stderr
+bool Flora::WriteStats()
+{
+	FILE *f = IsStdStream(stats_file) ? stderr : fopen(stats_file, "w");
+	if (!f)
+		return false;
+	stats.wall[PHASE_PARSE] -= stats.wall[PHASE_INFER];	// infer is timed within parse
+	stats.cpu[PHASE_PARSE] -= stats.cpu[PHASE_INFER];
+	double wall = MillisecondsSince(stats.run_start), cpu = CPUMilliseconds() - stats.run_cpu_start;
+	fprintf(f, "{\n\t\"flowers\": %d,\n\t\"width\": %d,\n\t\"height\": %d,\n\t\"phases\": {\n",
+			stats.flowers, bitmap ? img_wid : 0, bitmap ? img_hgt : 0);
+	for (int p=0; p<PHASE_COUNT; p++)
+		fprintf(f, "\t\t\"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f }%s\n", phase_name[p],
+				stats.wall[p], stats.cpu[p], p<(PHASE_COUNT-1) ? "," : "");
+	fprintf(f, "\t},\n\t\"total\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f },\n", wall, cpu);
+	fprintf(f, "\t\"counters\": {\n\t\t\"place_next_to\": %llu,\n\t\t\"collision_tests\": %llu,\n"
+			"\t\t\"fallbacks\": %llu,\n\t\t\"pixels_tested\": %llu\n\t},\n",
+			(unsigned long long)stats.place_calls, (unsigned long long)stats.collision_tests,
+			(unsigned long long)stats.fallbacks, (unsigned long long)stats.pixels);
+	fprintf(f, "\t\"memory\": {\n\t\t\"arena_peak_bytes\": %llu", (unsigned long long)memory.peak);
+#ifndef WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)==0) {
+#ifdef __APPLE__
+		long rss_kb = long(usage.ru_maxrss / 1024);	// bytes on mac
+#else
+		long rss_kb = long(usage.ru_maxrss);
+#endif
+		fprintf(f, ",\n\t\t\"peak_rss_kb\": %ld", rss_kb);
 	}
+#endif
+	fprintf(f, "\n\t}\n}\n");
+	return f==stderr ? true : fclose(f)==0;
+}
 
-	free(bitmap);
-	printf("Done!\n");
-	return 0;
+int Flora::Do()
+{
+	// INSTRUCTIONS CHECK
+	if (out_file && (*out_file=='?' || strcasecmp(out_file, "help")==0 || strcasecmp(out_file, "-h")==0 || strcasecmp(out_file, "h")==0)) {
+		Message("%s", Instructions);
+		return 0;
+	}
+	
+	// IMAGE TO STDOUT, KEEP IT CLEAN
+	if (!out_file && IsStdStream(data_file))
+		out_file = "-";
+	if (IsStdStream(out_file))
+		messages = stderr;
+	
+	int ret = Render();
+	bool painted = bitmap!=nullptr;
+	if (painted && out_file && !Save()) {
+		Message(progress.cancelled() ? "Cancelled\n" : "Could not save \"%s\"\n", out_file);
+		ret = 1;
+	}
+	if (stats_file && !WriteStats())
+		Message("Could not write stats \"%s\"\n", stats_file);
+	EndRun();
+	if (painted)
+		Message("Done!\n");
+	return ret;
 }
 
 
 //
 //
-// ENTRY POINT
+// BATCH
 //
 //
 
-int main(int argc, char **argv)
+// arguments as given on the command line, "-" is the csv file first and the image after
+void ParseArguments(Flora &flora, int count, const char *const *args)
 {
-	// PARSE COMMAND LINE ARGUMENTS
-	for (int a=1; a<argc; a++) {
-		if (const char *arg = strchr(argv[a], '=')) {
-			if (!flora.Argument(argv[a], arg+1))
-				printf("unknown property pair %s\n", argv[a]);
+	for (int a=0; a<count; a++) {
+		if (IsStdStream(args[a])) {
+			if (!flora.data_file)
+				flora.data_file = args[a];
+			else
+				flora.out_file = args[a];
+		} else if (const char *arg = strchr(args[a], '=')) {
+			if (!flora.Argument(args[a], arg+1))
+				flora.Message("unknown property pair %s\n", args[a]);
 		} else {
-			int argl = (int)strlen(argv[a]); const char *arge=argv[a]+argl;
+			int argl = (int)strlen(args[a]); const char *arge=args[a]+argl;
 			if (argl>3) {
-				if (strcasecmp(arge-4, ".csv")==0)
-					flora.data_file = argv[a];
+				if (strcasecmp(arge-4, ".csv")==0 || (argl>6 && strcasecmp(arge-6, COMPILED_EXT)==0))
+					flora.data_file = args[a];
 				else if ( strcasecmp(arge-4, ".png")==0 ||
 						  strcasecmp(arge-4, ".tga")==0 ||
 						  strcasecmp(arge-4, ".bmp")==0)
-					flora.out_file = argv[a];
+					flora.out_file = args[a];
+			}
+		}
+	}
+}
+
+struct batch_job {
+	const char **args;
+	int count;
+	int result;
+	const char *output;
+	double ms;
+};
+
+// each row of the batch file is the command line of a job, the arguments of the batch
+// itself come first. jobs run on all threads with fonts loaded once and memory kept by
+// each thread between jobs.
+int Flora::Batch(int argc, const char *const *argv)
+{
+	char manifest[512], summary_buf[512];
+	const char *summary = strchr(batch_file, ':');
+	size_t manifest_len = summary ? size_t(summary-batch_file) : strlen(batch_file);
+	if (manifest_len>=sizeof(manifest))
+		return 1;
+	memcpy(manifest, batch_file, manifest_len);
+	manifest[manifest_len] = 0;
+	if (summary)
+		summary++;
+	else {	// next to the batch file
+		int last_dot = (int)manifest_len-1;
+		while (last_dot>=0 && manifest[last_dot]!='.' && manifest[last_dot]!='/' && manifest[last_dot]!='\\') last_dot--;
+		if (last_dot<0 || manifest[last_dot]!='.') last_dot = (int)manifest_len;
+		snprintf(summary_buf, sizeof(summary_buf), "%.*s_summary.csv", last_dot, manifest);
+		summary = summary_buf;
+	}
+
+	// READ THE JOBS
+	int num_jobs = 0, cap_jobs = 0;
+	batch_job *jobs = nullptr;
+	csv_stream csv;
+	if (!csv.open(manifest)) {
+		Message("Could not open batch file \"%s\"\n", manifest);
+		return 1;
+	}
+	while (csv.next()) {
+		for (int p=0; p<csv.num_parts; p++) {
+			const csv_rows &rows = csv.parts[p];
+			for (int r=0; r<rows.num_rows; r++) {
+				if (num_jobs==cap_jobs) {
+					jobs = memory.grow(jobs, cap_jobs, cap_jobs ? cap_jobs*2 : 64);
+					cap_jobs = cap_jobs ? cap_jobs*2 : 64;
+				}
+				batch_job &job = jobs[num_jobs];
+				job.args = memory.alloc<const char*>(argc + rows.row_end[r]-rows.row_start(r));
+				job.count = 0;
+				for (int a=0; a<argc; a++) {
+					const char *eq = strchr(argv[a], '=');
+					if (!eq || (eq+1)!=batch_file)	// not the batch itself
+						job.args[job.count++] = argv[a];
+				}
+				int own = 0;
+				for (int c=rows.row_start(r); c<rows.row_end[r]; c++) {
+					if (*rows.cells[c]) {
+						job.args[job.count++] = strings.keep(rows.cells[c]);
+						own++;
+					}
+				}
+				job.result = 1;
+				job.output = nullptr;
+				job.ms = 0.0;
+				if (own)
+					num_jobs++;
+			}
+		}
+	}
+	csv.close();
+
+	// RUN THE JOBS
+	font_cache shared_fonts;
+	preset_cache shared_presets;
+	std::mutex output_lock;	// strings of this run are kept one job at a time
+	std::atomic<int> next_job(0);
+	int workers = Threads().threads()<num_jobs ? Threads().threads() : num_jobs;
+	Message("Batch of %d jobs on %d threads\n", num_jobs, workers);
+	std::chrono::steady_clock::time_point batch_start = std::chrono::steady_clock::now();
+	auto work = [&]() {
+		arena kept;
+		for (int j=next_job++; j<num_jobs; j=next_job++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			Flora run;
+			run.messages = nullptr;
+			run.fonts = &shared_fonts;
+			run.preset_files = &shared_presets;
+			run.memory.swap(kept);
+			ParseArguments(run, jobs[j].count, jobs[j].args);
+			if (!run.out_file && IsStdStream(run.data_file))
+				run.out_file = "-";
+			if (IsStdStream(run.out_file))
+				run.out_file = nullptr;	// jobs don't share stdout
+			// a job that paints nothing failed unless it only compiles
+			int result = run.Render();
+			if (!run.bitmap && !run.compile_file)
+				result = 1;
+			else if (run.bitmap && run.out_file && !run.Save())
+				result = 1;
+			jobs[j].result = result;
+			if (run.stats_file && run.stats_file!=stats_file && !run.WriteStats())	// only stats= of the row
+				jobs[j].result = 1;
+			run.EndRun();
+			if (run.out_file) {
+				std::lock_guard<std::mutex> guard(output_lock);
+				jobs[j].output = strings.keep(run.out_file);
+			}
+			run.memory.swap(kept);
+			jobs[j].ms = MillisecondsSince(start);
+			Message("Job %d \"%s\" %s in %.1f ms\n", j+1, jobs[j].output ? jobs[j].output : "",
+					jobs[j].result ? "failed" : "done", jobs[j].ms);
+		}
+	};
+	std::thread *threads = workers>1 ? new std::thread[workers-1] : nullptr;
+	for (int w=1; w<workers; w++)
+		threads[w-1] = std::thread(work);
+	work();
+	for (int w=1; w<workers; w++)
+		threads[w-1].join();
+	delete[] threads;
+	double batch_ms = MillisecondsSince(batch_start);
+
+	// SUMMARY
+	int failed = 0;
+	FILE *f = fopen(summary, "w");
+	if (f)
+		fprintf(f, "job,output,result,ms\n");
+	for (int j=0; j<num_jobs; j++) {
+		if (jobs[j].result)
+			failed++;
+		if (f)
+			fprintf(f, "%d,\"%s\",%s,%.3f\n", j+1, jobs[j].output ? jobs[j].output : "",
+					jobs[j].result ? "failed" : "ok", jobs[j].ms);
+	}
+	if (f) {
+		fprintf(f, "total,,%d failed,%.3f\n", failed, batch_ms);
+		fclose(f);
+	} else
+		Message("Could not write summary \"%s\"\n", summary);
+	Message("Rendered %d of %d jobs in %.1f ms, summary in \"%s\"\n", num_jobs-failed, num_jobs, batch_ms, summary);
+	EndRun();
+	return failed ? 1 : 0;
+}
+
+
+//
+//
+// SERVE
+//
+//
+
+#ifndef WIN32
+#define SERVE_HEADER_MAX (64<<10)
+#define SERVE_BODY_MAX (256<<20)	// largest csv accepted in a request
+#define SERVE_TIMEOUT_S 10			// a client that sends nothing for this long is dropped
+
+// listen on a unix domain socket, or on localhost when the address is a port number
+static int OpenListener(const char *addr)
+{
+	int fd = -1;
+	char *end;
+	long port = strtol(addr, &end, 10);
+	if (*addr && !*end) {
+		if (port<=0 || port>65535 || (fd = socket(AF_INET, SOCK_STREAM, 0))<0)
+			return -1;
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons((u16)port);
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (sockaddr*)&sa, sizeof(sa))<0) { close(fd); return -1; }
+	} else {
+		sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		if (strlen(addr)>=sizeof(sa.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0))<0)
+			return -1;
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, addr);
+		struct stat st;
+		if (stat(addr, &st)==0 && S_ISSOCK(st.st_mode))
+			unlink(addr);	// left by an earlier run
+		if (bind(fd, (sockaddr*)&sa, sizeof(sa))<0) { close(fd); return -1; }
+	}
+	if (listen(fd, 64)<0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool SendAll(int client, const void *data, size_t size)
+{
+	const char *p = (const char*)data;
+	while (size) {
+		ssize_t sent = send(client, p, size, 0);
+		if (sent<0 && errno==EINTR)
+			continue;
+		if (sent<=0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static int SendResponse(int client, int status, const char *reason, const char *type, const void *body, size_t size)
+{
+	char header[256];
+	int len = snprintf(header, sizeof(header), "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n",
+					   status, reason, type, (unsigned long long)size);
+	if (SendAll(client, header, len) && size)
+		SendAll(client, body, size);
+	return status;
+}
+
+static int SendError(int client, int status, const char *reason)
+{
+	return SendResponse(client, status, reason, "text/plain", reason, strlen(reason));
+}
+
+// decode %xx and + of a query in place
+static void DecodeQuery(char *str)
+{
+	char *w = str;
+	for (const char *r=str; *r; r++) {
+		if (*r=='+')
+			*w++ = ' ';
+		else if (*r=='%' && isxdigit((u8)r[1]) && isxdigit((u8)r[2])) {
+			char hex[3] = { r[1], r[2], 0 };
+			*w++ = (char)strtol(hex, nullptr, 16);
+			r += 2;
+		} else
+			*w++ = *r;
+	}
+	*w = 0;
+}
+
+// find a header in the headers of a request, returns the value or nullptr
+static const char *FindHeader(const char *headers, const char *name)
+{
+	size_t len = strlen(name);
+	for (const char *line = headers; line && *line; line = strchr(line, '\n')) {
+		if (*line=='\n') line++;
+		if (strncasecmp(line, name, len)==0 && line[len]==':') {
+			line += len+1;
+			while (*line==' ' || *line=='\t') line++;
+			return line;
+		}
+	}
+	return nullptr;
+}
+
+// one http request per connection: the csv is the body, arguments are the query and
+// the extension of the path picks png, tga or bmp. returns the http status.
+static int ServeClient(int client, Flora &run, int argc, const char *const *argv, const char *skip, size_t &sent)
+{
+	arena &memory = run.memory;
+	size_t cap = 16384, got = 0;
+	char *req = memory.alloc<char>(cap+1), *body = nullptr;
+	for (;;) {	// up to the end of the headers
+		ssize_t r = recv(client, req+got, cap-got, 0);
+		if (r<0 && errno==EINTR)
+			continue;
+		if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return SendError(client, 408, "Request Timeout");
+		if (r<=0)
+			return SendError(client, 400, "Bad Request");
+		got += r;
+		req[got] = 0;
+		if ((body = strstr(req, "\r\n\r\n")))
+			break;
+		if (got==cap) {
+			if (cap>=SERVE_HEADER_MAX)
+				return SendError(client, 431, "Request Header Fields Too Large");
+			req = memory.grow(req, cap+1, cap*2+1);
+			cap *= 2;
+		}
+	}
+	*body = 0;
+	body += 4;
+	size_t header_size = body-req, body_size = got-header_size;
+
+	// METHOD PATH?QUERY VERSION
+	char *path = strchr(req, ' ');
+	if (!path)
+		return SendError(client, 400, "Bad Request");
+	*path++ = 0;
+	char *version = strchr(path, ' ');
+	if (!version)
+		return SendError(client, 400, "Bad Request");
+	*version++ = 0;
+	bool post = strcmp(req, "POST")==0 || strcmp(req, "PUT")==0;
+	if (!post && strcmp(req, "GET")!=0)
+		return SendError(client, 405, "Method Not Allowed");
+	if (const char *te = FindHeader(version, "Transfer-Encoding"))
+		if (strncasecmp(te, "identity", 8)!=0)
+			return SendError(client, 411, "Length Required");
+
+	// BODY
+	if (post) {
+		const char *cl = FindHeader(version, "Content-Length");
+		size_t length = 0;
+		if (cl) {	// only digits, checked before it can overflow
+			if (!isdigit((u8)*cl))
+				return SendError(client, 400, "Bad Request");
+			for (; isdigit((u8)*cl); cl++) {
+				length = length*10 + size_t(*cl-'0');
+				if (length>SERVE_BODY_MAX)
+					return SendError(client, 413, "Payload Too Large");
+			}
+			while (*cl==' ' || *cl=='\t') cl++;
+			if (*cl && *cl!='\r' && *cl!='\n')
+				return SendError(client, 400, "Bad Request");
+		}
+		size_t need = header_size + (cl ? length : body_size);
+		for (;;) {
+			if (cl && got>=need)
+				break;
+			if (got==cap) {
+				if (!cl && (got-header_size)>=SERVE_BODY_MAX)
+					return SendError(client, 413, "Payload Too Large");
+				size_t grow = cl ? need : cap*2;
+				req = memory.grow(req, cap+1, grow+1);
+				if (!req)
+					return SendError(client, 413, "Payload Too Large");
+				body = req + header_size;
+				cap = grow;
+			}
+			ssize_t r = recv(client, req+got, cap-got, 0);
+			if (r<0 && errno==EINTR)
+				continue;
+			if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+				return SendError(client, 408, "Request Timeout");
+			if (r<=0)	// without a length the body ends when the client stops sending
+				break;
+			got += r;
+		}
+		body_size = (cl && got>need ? need : got) - header_size;
+		if (cl && body_size<length)
+			return SendError(client, 400, "Bad Request");
+	}
+
+	// ARGUMENTS OF THE SERVER, THEN THE QUERY
+	for (int a=0; a<argc; a++) {
+		const char *eq = strchr(argv[a], '=');
+		if (!eq || (eq+1)!=skip)
+			ParseArguments(run, 1, argv+a);
+	}
+	// files stay with the server, the query and csv argument rows can't name any
+	run.no_files = true;
+	char *query = strchr(path, '?');
+	if (query) {
+		*query++ = 0;
+		for (char *pair=query; pair && *pair;) {
+			char *next = strchr(pair, '&');
+			if (next)
+				*next++ = 0;
+			DecodeQuery(pair);
+			if (char *eq = strchr(pair, '=')) {
+				*eq = 0;
+				if (FileArgument(ArgumentIndex(pair)))
+					return SendError(client, 403, "Forbidden");
+				run.Argument(pair, eq+1);
+			}
+			pair = next;
+		}
+	}
+	run.out_file = nullptr;
+	run.compile_file = nullptr;
+	run.stats_file = nullptr;
+	if (body_size) {
+		run.data_text = body;
+		run.data_text_size = body_size;
+	}
+	size_t path_len = strlen(path);
+	const char *format = path_len>=4 && path[path_len-4]=='.' ? path+path_len-3 : "png";
+	const char *type = strcasecmp(format, "png")==0 ? "image/png" :
+		(strcasecmp(format, "tga")==0 ? "image/x-tga" : (strcasecmp(format, "bmp")==0 ? "image/bmp" : nullptr));
+	if (!type)
+		return SendError(client, 404, "Not Found");
+
+	// RENDER
+	run.Render();
+	if (!run.bitmap)
+		return SendError(client, 422, "Nothing to render");
+	encode_buffer image = { &memory, nullptr, 0, 0 };
+	if (!run.Encode(format, WriteToBuffer, &image))
+		return SendError(client, 500, "Internal Server Error");
+	sent = image.size;
+	return SendResponse(client, 200, "OK", type, image.data, image.size);
+}
+#endif
+
+// render http requests until the process is stopped, fonts, presets, threads and the
+// memory of each thread stay from one request to the next
+int Flora::Serve(int argc, const char *const *argv)
+{
+#ifdef WIN32
+	(void)argc; (void)argv;
+	Message("serve= needs unix sockets\n");
+	return 1;
+#else
+	int listener = OpenListener(serve_addr);
+	if (listener<0) {
+		Message("Could not listen on \"%s\"\n", serve_addr);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);	// clients that hang up early are not fatal
+	font_cache shared_fonts;
+	preset_cache shared_presets;
+	std::atomic<int> requests(0);
+	int workers = Threads().threads();
+	Message("Serving \"%s\" on %d threads\n", serve_addr, workers);
+	fflush(messages);
+	auto work = [&]() {
+		arena kept;
+		for (;;) {
+			int client = accept(listener, nullptr, nullptr);
+			if (client<0) {
+				if (errno==EINTR || errno==ECONNABORTED)
+					continue;
+				break;
+			}
+			timeval timeout = { SERVE_TIMEOUT_S, 0 };
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			Flora run;
+			run.messages = nullptr;
+			run.fonts = &shared_fonts;
+			run.preset_files = &shared_presets;
+			run.memory.swap(kept);
+			size_t sent = 0;
+			int status = ServeClient(client, run, argc, argv, serve_addr, sent);
+			close(client);
+			run.EndRun();
+			run.memory.swap(kept);
+			if (messages) {
+				Message("Request %d: %d, %llu bytes in %.1f ms\n", ++requests, status, (unsigned long long)sent, MillisecondsSince(start));
+				fflush(messages);
 			}
 		}
+	};
+	std::thread *threads = workers>1 ? new std::thread[workers-1] : nullptr;
+	for (int w=1; w<workers; w++)
+		threads[w-1] = std::thread(work);
+	work();
+	for (int w=1; w<workers; w++)
+		threads[w-1].join();
+	delete[] threads;
+	close(listener);
+	Message("Stopped serving \"%s\"\n", serve_addr);
+	return 1;
+#endif
+}
+
+
+//
+//
+// LIBRARY
+//
+//
+
+Flora* DaisyCreate()
+{
+	Flora *flora = new Flora;
+	flora->messages = nullptr;
+	return flora;
+}
+
+void DaisyDestroy(Flora *flora)
+{
+	if (flora) {
+		flora->EndRun();
+		delete flora;
+	}
+}
+
+void DaisyMessages(Flora *flora, FILE *messages)
+{
+	flora->messages = messages;
+}
+
+bool DaisyArgument(Flora *flora, const char *command, const char *arg)
+{
+	if (!arg) {
+		if (const char *eq = strchr(command, '='))
+			arg = eq+1;
+		else
+			return false;
+	}
+	return flora->Argument(flora->strings.keep(command), flora->strings.keep(arg));
+}
+
+void DaisyCSV(Flora *flora, const char *text, size_t size)
+{
+	flora->data_text = text;
+	flora->data_text_size = size;
+	flora->data_cells = nullptr;
+}
+
+void DaisyTable(Flora *flora, const char **cells, int columns, int rows)
+{
+	flora->data_cells = cells;
+	flora->data_columns = columns;
+	flora->data_rows = rows;
+	flora->data_text = nullptr;
+}
+
+void DaisyFlowers(Flora *flora, const double *values, const char **names, int count)
+{
+	const char **cells = flora->memory.alloc<const char*>(size_t(count+1)*2);
+	cells[0] = "value";
+	cells[1] = "name";
+	for (int n=0; n<count; n++) {
+		char num[32];
+		snprintf(num, sizeof(num), "%.17g", values[n]);	// enough digits to read back the same double
+		cells[n*2+2] = flora->strings.keep(num);
+		cells[n*2+3] = names && names[n] ? flora->strings.keep(names[n]) : "";
 	}
+	DaisyTable(flora, cells, 2, count+1);
+}
+
+void DaisyProgress(Flora *flora, daisy_progress func, void *context)
+{
+	flora->progress.func = func;
+	flora->progress.context = context;
+}
+
+void DaisyCancel(Flora *flora)
+{
+	flora->progress.cancel.store(true, std::memory_order_relaxed);
+}
+
+const unsigned char* DaisyRender(Flora *flora, int &width, int &height)
+{
+	if (!flora->rendered)
+		flora->Render();
+	width = flora->bitmap ? flora->img_wid : 0;
+	height = flora->bitmap ? flora->img_hgt : 0;
+	return (const unsigned char*)flora->bitmap;
+}
+
+const unsigned char* DaisyEncode(Flora *flora, const char *format, size_t &size)
+{
+	int width, height;
+	size = 0;
+	const unsigned char *bitmap = DaisyRender(flora, width, height);
+	if (!bitmap)
+		return nullptr;
+	encode_buffer buf = { &flora->memory, nullptr, 0, 0 };
+	if (!flora->Encode(format, WriteToBuffer, &buf))
+		return nullptr;
+	size = buf.size;
+	return buf.data;
+}
+
+
+//
+//
+// ENTRY POINT
+//
+//
+
+#ifndef DAISYSTATS_LIBRARY
+int main(int argc, char **argv)
+{
+	Flora flora;
+	
+	// "-" reads csv from stdin or writes the image to stdout, keep messages out of the way
+	for (int a=1; a<argc; a++)
+		if (IsStdStream(argv[a]))
+			flora.messages = stderr;
+	
+	// PARSE COMMAND LINE ARGUMENTS
+	ParseArguments(flora, argc-1, argv+1);
 
+	if (flora.serve_addr)
+		return flora.Serve(argc-1, argv+1);
+	if (flora.batch_file)
+		return flora.Batch(argc-1, argv+1);
 	return flora.Do();
 }
+#endif
 
 
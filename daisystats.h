@@ -0,0 +1,64 @@
+/*
+	Copyright 2015 Carl-Henrik Skårstedt. All rights reserved.
+
+	https://github.com/sakrac/daisystats
+ */
+#ifndef DAISYSTATS_H
+#define DAISYSTATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// DaisyStats as a library, compile daisystats.cpp with DAISYSTATS_LIBRARY to leave out main.
+//
+// A context holds the arguments, data and memory of one render. A context renders once,
+// create a new one for the next image. Separate contexts can render at the same time on
+// different threads, the worker threads are shared and their parallel sections take turns.
+//
+// Strings passed in are copied unless noted otherwise.
+
+struct Flora;
+
+// a context with default arguments and messages turned off
+Flora* DaisyCreate();
+
+// release a context and everything it rendered
+void DaisyDestroy(Flora *flora);
+
+// progress and diagnostics go to messages, nullptr for silence
+void DaisyMessages(Flora *flora, FILE *messages);
+
+// set an argument as "name=value" or as name and value, same as the command line
+bool DaisyArgument(Flora *flora, const char *command, const char *arg = nullptr);
+
+// read flowers from csv text instead of a data file, text must stay valid until rendered
+void DaisyCSV(Flora *flora, const char *text, size_t size);
+
+// read flowers from rows of cells instead of a data file, the first row is the column titles.
+// cells are stored by row and must stay valid until rendered, nullptr cells are empty
+void DaisyTable(Flora *flora, const char **cells, int columns, int rows);
+
+// one flower per value with an optional name per flower, names can be nullptr
+void DaisyFlowers(Flora *flora, const double *values, const char **names, int count);
+
+// progress of a phase of a render ("parse", "pack", "paint" or "encode"), done out of total
+// where total is 0 when not known, and the estimated seconds left or -1
+typedef void (*daisy_progress)(void *context, const char *phase, long long done, long long total, double seconds_left);
+
+// report progress to func on the rendering thread a few times a second and when a phase
+// is done, nullptr stops reporting
+void DaisyProgress(Flora *flora, daisy_progress func, void *context);
+
+// stop a render as soon as it can, can be called from any thread or from the progress.
+// a cancelled render returns nullptr
+void DaisyCancel(Flora *flora);
+
+// render the image and return its RGBA pixels, nullptr if nothing could be rendered.
+// the pixels are valid until the context is destroyed
+const unsigned char* DaisyRender(Flora *flora, int &width, int &height);
+
+// render if needed and encode the image as "png", "tga" or "bmp".
+// the encoded image is valid until the context is destroyed
+const unsigned char* DaisyEncode(Flora *flora, const char *format, size_t &size);
+
+#endif // DAISYSTATS_H
@@ -0,0 +1,384 @@
+/*
+	Copyright 2015 Carl-Henrik Skårstedt. All rights reserved.
+
+	https://github.com/sakrac/daisystats
+ */
+// Benchmarks of the hot paths of daisystats and of rendering the samples.
+//
+// Build next to daisystats.cpp and the stb headers, then run in the samples folder:
+//	g++ -O2 -std=c++14 -o DaisyBench DaisyBench.cpp -lpthread
+//	DaisyBench [results.json] [baseline=DaisyBench_baseline.json] [threshold=10] [filter=<prefix>]
+//
+// Each benchmark doubles its iterations until a batch takes BATCH_MS, the fastest of
+// a few batches is the result. Results are written as json and compared with the
+// baseline, anything slower than the baseline by more than threshold percent is a
+// regression and the exit code is 1. Copy the results over the baseline to accept them.
+// There is no baseline until the results of a first run on this machine are copied to it.
+// Before ReadCSV is timed a few quoted csv texts are checked to read as they should.
+#define DAISYSTATS_LIBRARY
+#include "../daisystats.cpp"
+
+#define BATCH_MS 10.0
+#define MICRO_BATCHES 5
+#define RENDER_BATCHES 3
+#define MAX_RESULTS 256
+#define BENCH_SEED 1
+
+struct bench_result {
+	char name[64];
+	double ms;		// per iteration
+	u64 iterations;
+};
+
+struct bench {
+	bench_result results[MAX_RESULTS];
+	int count;
+	const char *filter;
+
+	bench() : count(0), filter(nullptr) {}
+
+	bool enabled(const char *name) const { return !filter || strncmp(name, filter, strlen(filter))==0; }
+
+	// time the fastest of batches of calls to run
+	template<class F> void measure(const char *name, int batches, const F &run)
+	{
+		if (!enabled(name) || count==MAX_RESULTS)
+			return;
+		u64 iterations = 1;
+		double best = DBL_MAX, total = 0.0;
+		u64 total_iterations = 0;
+		for (int b=0; b<batches;) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (u64 i=0; i<iterations; i++)
+				run();
+			double ms = MillisecondsSince(start);
+			total += ms;
+			total_iterations += iterations;
+			if (ms<BATCH_MS && total<1000.0 && iterations<(1ULL<<32)) {	// too short to time, try more
+				iterations *= 2;
+				continue;
+			}
+			if ((ms/iterations)<best)
+				best = ms/iterations;
+			b++;
+		}
+		bench_result &r = results[count++];
+		snprintf(r.name, sizeof(r.name), "%s", name);
+		r.ms = best;
+		r.iterations = total_iterations;
+		printf("%-40s %12.4f ms  (%llu)\n", name, best, (unsigned long long)total_iterations);
+		fflush(stdout);
+	}
+
+	bool write(const char *filename) const
+	{
+		FILE *f = fopen(filename, "w");
+		if (!f)
+			return false;
+		fprintf(f, "{\n\t\"benchmarks\": [\n");
+		for (int i=0; i<count; i++)
+			fprintf(f, "\t\t{ \"name\": \"%s\", \"ms\": %.6f, \"iterations\": %llu }%s\n", results[i].name,
+					results[i].ms, (unsigned long long)results[i].iterations, i<(count-1) ? "," : "");
+		fprintf(f, "\t]\n}\n");
+		return fclose(f)==0;
+	}
+
+	// compare with a baseline written by write, returns the number of regressions
+	int compare(const char *filename, double threshold) const
+	{
+		size_t size;
+		arena memory;
+		char *text = ReadFile(filename, size, memory, 1);
+		if (!text) {
+			printf("No baseline \"%s\"\n", filename);
+			return 0;
+		}
+		text[size] = 0;
+		int regressions = 0;
+		printf("\n%-40s %12s %12s %8s\n", "benchmark", "ms", "baseline", "change");
+		for (int i=0; i<count; i++) {
+			char key[80];
+			snprintf(key, sizeof(key), "\"name\": \"%s\"", results[i].name);
+			const char *found = strstr(text, key);
+			const char *ms = found ? strstr(found, "\"ms\":") : nullptr;
+			if (!ms) {
+				printf("%-40s %12.4f %12s\n", results[i].name, results[i].ms, "new");
+				continue;
+			}
+			double base = strtod(ms+5, nullptr);
+			double change = base>0.0 ? 100.0*(results[i].ms/base-1.0) : 0.0;
+			bool slower = change>threshold;
+			printf("%-40s %12.4f %12.4f %+7.1f%%%s\n", results[i].name, results[i].ms, base, change, slower ? "  REGRESSION" : "");
+			if (slower)
+				regressions++;
+		}
+		return regressions;
+	}
+};
+
+// radii spread like real data, a few large and many small
+static void BenchRadii(flower_pack *packs, int count)
+{
+	rng random(BENCH_SEED, RNG_OTHER);
+	for (int i=0; i<count; i++) {
+		packs[i].x = packs[i].y = 0.0;
+		packs[i].r = 1.0 + 20.0*dblrand(random)*dblrand(random);
+	}
+}
+
+// csv text of name and value rows with some ranges, names repeat every cardinality rows
+static char* BenchCSV(int rows, int cardinality, size_t &size, arena &memory)
+{
+	rng random(BENCH_SEED, RNG_ROWS);
+	size_t cap = 64 + size_t(rows)*48;
+	char *text = memory.alloc<char>(cap);
+	size = (size_t)snprintf(text, cap, "name,value,color1\n");
+	for (int r=0; r<rows; r++) {
+		// log-normal values
+		double u1 = dblrand(random)+1e-12, u2 = dblrand(random);
+		double value = exp(1.5*sqrt(-2.0*log(u1))*cos(2.0*pi_dbl*u2));
+		if (r%4)
+			size += (size_t)snprintf(text+size, cap-size, "n%d,%.3f,%06x\n", r%cardinality, value, (unsigned int)(random.next()&0xffffff));
+		else
+			size += (size_t)snprintf(text+size, cap-size, "\"n%d, ranged\",%.3f to %.3f,red to blue\n", r%cardinality, value, value*1.5);
+	}
+	return text;
+}
+
+// csv text and its cells with | between cells and / after each row, quotes only open at the
+// start of a cell like the original reader so the stray quote in 5" stays in one row
+static const char *csv_checks[][2] = {
+	{ "value,name\n3,5\" screen\n4,b\n6,c", "value|name/3|5 screen/4|b/6|c/" },
+	{ "a,\"b,c\",\"d\"\"e\"\n", "a|b,c|d\"e/" },
+	{ "a,\"x\"y\"z\",b\n", "a|xyz|b/" },
+	{ "a, \"b,c\"\n", "a|b|c/" },
+	{ "\"multi\nline\",1\n2,\"\"\n", "multi\nline|1/2|/" },
+};
+
+// read csv text and compare its cells with expect, prints the cells if they differ
+static bool CheckCSV(const char *text, const char *expect, arena &memory)
+{
+	char cells[256] = "";
+	size_t len = 0;
+	csv_stream csv;
+	if (csv.open_text(text, strlen(text), memory)) {
+		while (csv.next()) {
+			for (int p=0; p<csv.num_parts; p++) {
+				const csv_rows &rows = csv.parts[p];
+				for (int r=0; r<rows.num_rows; r++) {
+					for (int c=rows.row_start(r); c<rows.row_end[r] && len<sizeof(cells); c++)
+						len += snprintf(cells+len, sizeof(cells)-len, c>rows.row_start(r) ? "|%s" : "%s", rows.cells[c]);
+					if (len<sizeof(cells))
+						len += snprintf(cells+len, sizeof(cells)-len, "/");
+				}
+			}
+		}
+	}
+	if (len<sizeof(cells) && strcmp(cells, expect)==0)
+		return true;
+	printf("ReadCSV check failed, \"%s\" reads as \"%.*s\"\n", expect, (int)(len<sizeof(cells) ? len : sizeof(cells)-1), cells);
+	return false;
+}
+
+static void CountBytes(void *context, void *data, int size)
+{
+	(void)data;
+	*(size_t*)context += (size_t)size;
+}
+
+// render a flora with seed and size and encode it, tga keeps the png compressor out of it
+static void BenchRender(const char *data_file, const char *text, size_t text_size)
+{
+	Flora *flora = DaisyCreate();
+	DaisyArgument(flora, "seed=1");
+	DaisyArgument(flora, "size=1024");
+	if (data_file)
+		DaisyArgument(flora, "data", data_file);
+	else
+		DaisyCSV(flora, text, text_size);
+	size_t size;
+	DaisyEncode(flora, "tga", size);
+	DaisyDestroy(flora);
+}
+
+// the samples that render in seconds, grayred.csv packs 28k flowers with make=box
+static const char *bench_samples[] = {
+	"goths.csv",
+	"orange_juice_2010.csv",
+	"rgb_preset.csv",
+	"rgb_rand_args.csv",
+	"seed_2012_args.csv",
+	"seed_market_share_revenue_2012.csv",
+	"wildflower_trail.csv",
+	"wildflowers.csv",
+};
+
+int main(int argc, char *argv[])
+{
+	const char *results_file = "DaisyBench_results.json";
+	const char *baseline_file = "DaisyBench_baseline.json";
+	double threshold = 10.0;
+	bench b;
+	for (int a=1; a<argc; a++) {
+		if (strncmp(argv[a], "baseline=", 9)==0)
+			baseline_file = argv[a]+9;
+		else if (strncmp(argv[a], "threshold=", 10)==0)
+			threshold = atof(argv[a]+10);
+		else if (strncmp(argv[a], "filter=", 7)==0)
+			b.filter = argv[a]+7;
+		else
+			results_file = argv[a];
+	}
+
+	arena memory;
+	run_stats stats;
+	run_progress progress;
+	char name[64];
+
+	// PLACE_NEXT_TO
+	{
+		const int count = 200;
+		flower_pack *packs = memory.alloc<flower_pack>(count+1);
+		BenchRadii(packs, count+1);
+		pack_flowers(packs, count, FIT_ROUND, 1.0, BENCH_SEED, memory, progress, stats);
+		snprintf(name, sizeof(name), "place_next_to/%d", count);
+		b.measure(name, MICRO_BATCHES, [&]() {
+			double best_dist = DBL_MAX, x = 0.0, y = 0.0;
+			for (int i=1; i<count; i++)
+				place_next_to(packs, packs+count, packs+i-1, packs+i, best_dist, x, y, 1.0, FIT_ROUND, stats);
+		});
+	}
+
+	// PACK_FLOWERS
+	{
+		struct { fit shape; int count; } packs_of[] = {
+			{ FIT_ROUND, 100 }, { FIT_ROUND, 500 }, { FIT_RECT, 100 }, { FIT_RECT, 500 },
+			{ FIT_FIRST, 100 }, { FIT_FIRST, 500 }, { FIT_LAST, 100 }, { FIT_LAST, 500 },
+			{ FIT_MOST, 50 }, { FIT_MOST, 100 }, { FIT_BOX, 50 }, { FIT_BOX, 100 },
+		};
+		for (size_t p=0; p<sizeof(packs_of)/sizeof(packs_of[0]); p++) {
+			int count = packs_of[p].count;
+			flower_pack *radii = memory.alloc<flower_pack>(count);
+			flower_pack *packs = memory.alloc<flower_pack>(count);
+			BenchRadii(radii, count);
+			snprintf(name, sizeof(name), "pack_flowers/%s/%d", fit_name[packs_of[p].shape], count);
+			b.measure(name, MICRO_BATCHES, [&]() {
+				memcpy(packs, radii, sizeof(flower_pack)*count);
+				pack_flowers(packs, count, packs_of[p].shape, 1.0, BENCH_SEED, memory, progress, stats);
+			});
+		}
+	}
+
+	// DRAWNPETAL
+	{
+		const int radii[] = { 8, 32, 128 };
+		const int petals[] = { 4, 8, 16 };
+		for (int r=0; r<3; r++) {
+			int ir = 2*(radii[r]+1), wid = 2*ir+3;
+			unsigned int *bitmap = memory.alloc_zero<unsigned int>(size_t(wid)*size_t(wid));
+			for (int p=0; p<3; p++) {
+				snprintf(name, sizeof(name), "drawnpetal/r%d/p%d", radii[r], petals[p]);
+				b.measure(name, MICRO_BATCHES, [&]() {
+					drawnpetal(bitmap, wid, ir+1.25, ir+1.5, radii[r], 0.2*radii[r], 0.3, 0.05, 0.25, 0xff00c0ff, 0xff004080, petals[p]);
+				});
+			}
+		}
+	}
+
+	// DRAWCODEPOINTAT
+	if (b.enabled("DrawCodepointAt")) {
+		font_state font;
+		if (InitFont(font, font_file, memory)) {
+			const int wid = 1024, hgt = 128;
+			unsigned int *bitmap = memory.alloc_zero<unsigned int>(size_t(wid)*size_t(hgt));
+			color c = { 255, 255, 255, 255 };
+			float scale = FontSizeScale(font, 64.0f);
+			b.measure("DrawCodepointAt/64px/A-Z", MICRO_BATCHES, [&]() {
+				for (int g=0; g<26; g++)
+					DrawCodepointAt(font, 'A'+g, 8.0+g*36.5, 96.0, scale, c, bitmap, wid, hgt);
+			});
+		} else
+			printf("%-40s skipped, no font \"%s\"\n", "DrawCodepointAt", font_file);
+	}
+
+	// READCSV
+	if (b.enabled("ReadCSV")) {
+		for (size_t c=0; c<sizeof(csv_checks)/sizeof(csv_checks[0]); c++) {
+			if (!CheckCSV(csv_checks[c][0], csv_checks[c][1], memory))
+				return 1;
+		}
+	}
+	{
+		const int rows[] = { 10000, 100000 };
+		for (int r=0; r<2; r++) {
+			size_t size;
+			const char *text = BenchCSV(rows[r], 100, size, memory);
+			snprintf(name, sizeof(name), "ReadCSV/%d", rows[r]);
+			b.measure(name, MICRO_BATCHES, [&]() {
+				Flora flora;
+				flora.messages = nullptr;
+				flora.data_text = text;
+				flora.data_text_size = size;
+				int count = 0;
+				flower_pack *packs = nullptr;
+				readValuesFromCSV(flora, nullptr, count, flora.strings, flora.memory, &packs);
+			});
+		}
+	}
+
+	// STBI_WRITE_PNG
+	{
+		const int sizes[] = { 512, 1024 };
+		for (int s=0; s<2; s++) {
+			int wid = sizes[s];
+			unsigned int *bitmap = memory.alloc<unsigned int>(size_t(wid)*size_t(wid));
+			for (int i=0; i<wid*wid; i++)
+				bitmap[i] = 0xff000000;
+			rng random(BENCH_SEED, RNG_OTHER);
+			for (int f=0; f<200; f++) {
+				double r = 4.0 + 0.05*wid*dblrand(random);
+				double x = r*2+2+(wid-r*4-4)*dblrand(random), y = r*2+2+(wid-r*4-4)*dblrand(random);
+				drawnpetal(bitmap, wid, x, y, r, 0.2*r, 0.0, 0.05, 0.25, 0xff00c0ff | (u32)(random.next()&0xffffff),
+						   0xff004080, 8);
+			}
+			snprintf(name, sizeof(name), "stbi_write_png/%d", wid);
+			b.measure(name, MICRO_BATCHES, [&]() {
+				size_t bytes = 0;
+				stbi_write_png_to_func(CountBytes, &bytes, wid, wid, 4, bitmap, 0);
+			});
+		}
+	}
+
+	// RENDER THE SAMPLES
+	for (size_t s=0; s<sizeof(bench_samples)/sizeof(bench_samples[0]); s++) {
+		FILE *f = fopen(bench_samples[s], "rb");
+		if (!f) {
+			printf("%-40s skipped, not in this folder\n", bench_samples[s]);
+			continue;
+		}
+		fclose(f);
+		snprintf(name, sizeof(name), "render/%s", bench_samples[s]);
+		b.measure(name, RENDER_BATCHES, [&]() { BenchRender(bench_samples[s], nullptr, 0); });
+	}
+
+	// RENDER GENERATED DATA
+	{
+		const int rows[] = { 500, 1500 };
+		for (int r=0; r<2; r++) {
+			size_t size;
+			const char *text = BenchCSV(rows[r], 20, size, memory);
+			snprintf(name, sizeof(name), "render/generated/%d", rows[r]);
+			b.measure(name, RENDER_BATCHES, [&]() { BenchRender(nullptr, text, size); });
+		}
+	}
+
+	if (!b.write(results_file)) {
+		printf("Could not write \"%s\"\n", results_file);
+		return 1;
+	}
+	printf("Results in \"%s\"\n", results_file);
+	int regressions = b.compare(baseline_file, threshold);
+	if (regressions)
+		printf("%d benchmarks are more than %.1f%% slower than \"%s\"\n", regressions, threshold, baseline_file);
+	return regressions ? 1 : 0;
+}
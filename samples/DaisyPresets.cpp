@@ -1,6 +1,8 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
 
 /*
@@ -10,15 +12,50 @@ ick,10 to 50,00f to 08f,888 to ccc,1 to 10,255,,,
 jock,5 to 25,cc1 to 446,000 to 888,1 to 10,255,255,,
 */
 
+/*
+ DaisyPresets <file> [count] [seed=<num>] [data] [dist=uniform/lognormal/zipf] [skew=<num>]
+			  [names=<num>] [ranges=<percent>] [quoted=<percent>]
+
+ Without data a preset file of count rows of value, color, petal and type ranges is written.
+ With data count rows of name,value,color1,color2,petal,type are written instead for testing
+ with large files:
+   dist: values are uniform 1 to 1000, log-normal around 10 or zipf 1 and up (default lognormal)
+   skew: zipf exponent or log-normal sigma (default 1.2)
+   names: number of different names, 0 leaves out the names (default 100)
+   ranges: percent of values, colors and petals written as 'low to high' (default 10)
+   quoted: percent of names quoted with a comma and a quote inside (default 5)
+ The same seed and arguments always write the same file.
+*/
+
+// xorshift64*, the same sequence on every system unlike rand()
+static unsigned long long rand_state = 1;
+
+void seedrand(unsigned long long seed)
+{
+	rand_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+unsigned int randbits()
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return (unsigned int)((rand_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
 int randrange(int range)
 {
-	int r = rand();
-	return (r+(r>>8))%range;
+	return (int)(randbits() % (unsigned int)range);
 }
 
 float randfloat()
 {
-	return (float)rand()/(float)RAND_MAX;
+	return (float)(randbits()>>8) / (float)(1<<24);
+}
+
+double randdouble()
+{
+	return ((double)randbits() + 0.5) / 4294967296.0;
 }
 
 int randcol(int colbase, int offsmax)
@@ -37,28 +74,143 @@ int randcol(int colbase, int offsmax)
 	return (r<<16) + (g<<8) + b;
 }
 
+enum distribution { DIST_UNIFORM, DIST_LOGNORMAL, DIST_ZIPF };
+const char *dist_names[] = { "uniform", "lognormal", "zipf" };
+
+#define ZIPF_MAX 65536	// largest zipf value
+
+// cumulative zipf weights of 1 to ZIPF_MAX, searched for each value
+double *zipf_table = NULL;
+
+void initzipf(double skew)
+{
+	zipf_table = (double*)malloc(sizeof(double) * ZIPF_MAX);
+	double sum = 0.0;
+	for (int k=0; k<ZIPF_MAX; k++) {
+		sum += 1.0 / pow((double)(k+1), skew);
+		zipf_table[k] = sum;
+	}
+	for (int k=0; k<ZIPF_MAX; k++)
+		zipf_table[k] /= sum;
+}
+
+double randvalue(distribution dist, double skew)
+{
+	switch (dist) {
+		case DIST_UNIFORM:
+			return 1.0 + 999.0 * randdouble();
+		case DIST_ZIPF: {
+			double u = randdouble();
+			int low = 0, high = ZIPF_MAX-1;
+			while (low<high) {
+				int mid = (low+high)/2;
+				if (zipf_table[mid]<u) low = mid+1;
+				else high = mid;
+			}
+			return (double)(low+1);
+		}
+		default: {	// box-muller
+			double n = sqrt(-2.0 * log(randdouble())) * cos(6.283185307179586 * randdouble());
+			return 10.0 * exp(skew * n);
+		}
+	}
+}
+
+bool chance(int percent)
+{
+	return randrange(100) < percent;
+}
+
+void writename(FILE *f, int names, int quoted)
+{
+	int n = randrange(names);
+	if (chance(quoted))
+		fprintf(f, "\"name %d, \"\"%d\"\"\",", n, n%10);
+	else
+		fprintf(f, "name %d,", n);
+}
+
+void writecolor(FILE *f, int ranges)
+{
+	int c0 = randcol(0x808080, 0x80);
+	if (chance(ranges))
+		fprintf(f, "%06x to %06x,", c0, randcol(c0, 0x20));
+	else
+		fprintf(f, "%06x,", c0);
+}
 
 int main(int argc, char *argv[])
 {
+	const char *filename = NULL;
+	long long count = 3;
+	unsigned long long seed = (unsigned long long)time(NULL);
+	bool data = false;
+	distribution dist = DIST_LOGNORMAL;
+	double skew = 1.2;
+	int names = 100, ranges = 10, quoted = 5;
+
+	for (int a=1; a<argc; a++) {
+		const char *arg = argv[a];
+		if (strncmp(arg, "seed=", 5)==0) seed = strtoull(arg+5, NULL, 10);
+		else if (strcmp(arg, "data")==0) data = true;
+		else if (strncmp(arg, "skew=", 5)==0) skew = atof(arg+5);
+		else if (strncmp(arg, "names=", 6)==0) names = atoi(arg+6);
+		else if (strncmp(arg, "ranges=", 7)==0) ranges = atoi(arg+7);
+		else if (strncmp(arg, "quoted=", 7)==0) quoted = atoi(arg+7);
+		else if (strncmp(arg, "dist=", 5)==0) {
+			for (int d=0; d<3; d++) {
+				if (strcmp(arg+5, dist_names[d])==0)
+					dist = (distribution)d;
+			}
+		} else if (!filename) filename = arg;
+		else count = atoll(arg);
+	}
+
 	FILE *f;
-	if (argc>1 && (f = fopen(argv[1], "w"))) {
-		srand ((unsigned int)time(NULL));
-		int count = argc>2 ? atoi(argv[2]) : 3;
-		fprintf(f, "value,color1,color2,petal,type\n");
-		for (int l=0; l<count; l++) {
-			float v0 = 0.95f * randfloat() + 0.05f;
-			float v1 = (1.0f-v0) * randfloat() + v0;
-			int c0 = randcol(0x808080, 0x80);
-			int c1 = randcol(c0, 0x20);
-			int c2 = randcol(0x808080, 0x80);
-			int c3 = randcol(c2, 0x20);
-			float p0 = randfloat()*0.95f+0.05f;
-			float p1 = p0 + 0.25f*randfloat();
-			if (p1<=0.001f) p1 =  0.001f;
-			else if (p1>0.999f) p1 = 0.999f;
-			fprintf(f, "%f to %f,%06x to %06x,%06x to %06x,%f to %f,%d\n", v0, v1, c0, c1, c2, c3, p0, p1, (randrange(23)&1) ? 8:4);
+	if (filename && (f = fopen(filename, "w"))) {
+		static char buffer[1<<20];
+		setvbuf(f, buffer, _IOFBF, sizeof(buffer));
+		seedrand(seed);
+		if (!data) {
+			fprintf(f, "value,color1,color2,petal,type\n");
+			for (long long l=0; l<count; l++) {
+				float v0 = 0.95f * randfloat() + 0.05f;
+				float v1 = (1.0f-v0) * randfloat() + v0;
+				int c0 = randcol(0x808080, 0x80);
+				int c1 = randcol(c0, 0x20);
+				int c2 = randcol(0x808080, 0x80);
+				int c3 = randcol(c2, 0x20);
+				float p0 = randfloat()*0.95f+0.05f;
+				float p1 = p0 + 0.25f*randfloat();
+				if (p1<=0.001f) p1 =  0.001f;
+				else if (p1>0.999f) p1 = 0.999f;
+				fprintf(f, "%f to %f,%06x to %06x,%06x to %06x,%f to %f,%d\n", v0, v1, c0, c1, c2, c3, p0, p1, (randrange(23)&1) ? 8:4);
+			}
+		} else {
+			if (dist==DIST_ZIPF)
+				initzipf(skew);
+			fprintf(f, names>0 ? "name,value,color1,color2,petal,type\n" : "value,color1,color2,petal,type\n");
+			for (long long l=0; l<count; l++) {
+				if (names>0)
+					writename(f, names, quoted);
+				double v = randvalue(dist, skew);
+				if (chance(ranges))
+					fprintf(f, "%.4g to %.4g,", v, v*(1.0+randdouble()));
+				else
+					fprintf(f, "%.4g,", v);
+				writecolor(f, ranges);
+				writecolor(f, ranges);
+				int p0 = 5 + randrange(90);
+				if (chance(ranges))
+					fprintf(f, "%d to %d,", p0, p0 + randrange(100-p0));
+				else
+					fprintf(f, "%d,", p0);
+				fprintf(f, "%d\n", 3 + randrange(14));
+			}
+			free(zipf_table);
 		}
 		fclose(f);
+		printf("Wrote %lld rows to %s with seed=%llu\n", count, filename, seed);
 	}
 	return 0;
-}
\ No newline at end of file
+}